@@ -0,0 +1,169 @@
+/** @file array.c
+ *  @brief Microphone array geometry
+ *
+ *  Arrays are described by a text file, one item per line, with blank lines
+ *  and anything after a '#' ignored:
+ *
+ *      mic <x> <y> <z> [<delay>]   position in m and, optionally, how late
+ *                                  the mic's channel is, in s
+ *      pairs <ring|all|list>       default mic pairs, as for `locate_pairs`
+ *
+ *  Mics are numbered in the order they're listed, which is the order of the
+ *  input channels.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "array.h"
+#include "file.h"
+
+#define SQRT_3 1.73205080756887729353
+
+/* 12/5 star, 1 m across; the mics of a 12-position ring (clockwise from
+ * the top) taken 5 positions apart
+ */
+static const vec3_t default_pos[] = {
+	{ .x =  0.0     , .y =  0.5       , .z = 0.0 },
+	{ .x =  0.25    , .y = -SQRT_3/4.0, .z = 0.0 },
+	{ .x = -SQRT_3/4, .y =  0.25      , .z = 0.0 },
+	{ .x =  0.5     , .y = -0.0       , .z = 0.0 },
+	{ .x = -SQRT_3/4, .y = -0.25      , .z = 0.0 },
+	{ .x =  0.25    , .y =  SQRT_3/4.0, .z = 0.0 },
+	{ .x = -0.0     , .y = -0.5       , .z = 0.0 },
+	{ .x = -0.25    , .y =  SQRT_3/4.0, .z = 0.0 },
+	{ .x =  SQRT_3/4, .y = -0.25      , .z = 0.0 },
+	{ .x = -0.5     , .y =  0.0       , .z = 0.0 },
+	{ .x =  SQRT_3/4, .y =  0.25      , .z = 0.0 },
+	{ .x = -0.25    , .y = -SQRT_3/4.0, .z = 0.0 },
+};
+
+/** @brief Sets up the built-in array
+ *  @param a Array to initialize
+ */
+void array_default(array_t *a)
+{
+	memset(a, 0, sizeof(*a));
+	a->n_mics = sizeof(default_pos) / sizeof(default_pos[0]);
+	memcpy(a->pos, default_pos, sizeof(default_pos));
+}
+
+/** @brief Parses whitespace-separated numbers
+ *  @param s String to parse
+ *  @param v Output; numbers
+ *  @param max Size of v
+ *  @return How many numbers were read, or -1 if there's a token that isn't a
+ *          number or more than max of them
+ */
+static int parse_numbers(const char *s, double *v, int max)
+{
+	int n = 0;
+
+	for (;;) {
+		char *end;
+
+		while (isspace((unsigned char)*s)) {
+			s++;
+		}
+		if (*s == '\0') {
+			return n;
+		}
+		if (n == max) {
+			return -1;
+		}
+		v[n] = strtod(s, &end);
+		if (end == s || (*end != '\0' && !isspace((unsigned char)*end))) {
+			return -1;
+		}
+		n++;
+		s = end;
+	}
+}
+
+/** @brief Loads an array from a file
+ *  @param filename Name of file to read
+ *  @param a Output; array
+ *  @return 0 on success, negative on failure
+ */
+int array_load(const char *filename, array_t *a)
+{
+	ssize_t size;
+	char *text, *line, *next;
+	int line_no = 0, ret = -1;
+
+	memset(a, 0, sizeof(*a));
+
+	text = file_read(filename, &size);
+	if (text == NULL) {
+		return -1;
+	}
+	/* room for the terminator */
+	char *tmp = realloc(text, size + 1);
+	if (tmp == NULL) {
+		fprintf(stderr, "%s: cannot allocate enough space to read\n", filename);
+		goto out;
+	}
+	text = tmp;
+	text[size] = '\0';
+
+	for (line = text; line != NULL; line = next) {
+		char word[16], rest[ARRAY_PAIRS_LEN];
+		double v[4] = { 0.0 };
+		int n;
+
+		/* split by hand rather than with strtok, which would skip blank
+		 * lines and throw the line numbers off
+		 */
+		next = strchr(line, '\n');
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+		line_no++;
+		char *comment = strchr(line, '#');
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+		if (sscanf(line, "%15s", word) != 1) {
+			continue; /* blank */
+		}
+
+		if (!strcmp(word, "mic")) {
+			n = parse_numbers(strstr(line, word) + strlen(word), v, 4);
+			if (n != 3 && n != 4) {
+				fprintf(stderr, "%s:%d: expected mic <x> <y> <z> [<delay>]\n",
+				        filename, line_no);
+				goto out;
+			}
+			if (a->n_mics == ARRAY_MICS_MAX) {
+				fprintf(stderr, "%s:%d: more than %d mics\n", filename, line_no,
+				        ARRAY_MICS_MAX);
+				goto out;
+			}
+			a->pos[a->n_mics] = (vec3_t){ v[0], v[1], v[2] };
+			a->delay[a->n_mics] = v[3];
+			a->n_mics++;
+		} else if (!strcmp(word, "pairs")) {
+			if (sscanf(line, "%*s %255s %1s", a->pairs, rest) != 1) {
+				fprintf(stderr, "%s:%d: expected pairs <ring|all|list>\n", filename, line_no);
+				goto out;
+			}
+		} else {
+			fprintf(stderr, "%s:%d: unknown item: %s\n", filename, line_no, word);
+			goto out;
+		}
+	}
+
+	if (a->n_mics < 2) {
+		fprintf(stderr, "%s: need at least 2 mics\n", filename);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	file_free(text);
+	return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef _ARRAY_H_
+#define _ARRAY_H_
+
+#include "globals.h"
+#include "vector.h"
+
+#define ARRAY_MICS_MAX 64
+#define ARRAY_PAIRS_LEN 256 /* longest pair list */
+
+/* microphone array geometry, channel i of the input being mic i */
+typedef struct {
+	int n_mics;
+	vec3_t pos[ARRAY_MICS_MAX];   /* m, relative to the array's centre */
+	real_t delay[ARRAY_MICS_MAX]; /* s, how late each mic's channel is */
+	char pairs[ARRAY_PAIRS_LEN];  /* pairs for `locate_pairs`, or empty for the
+	                                 program's default */
+} array_t;
+
+void array_default(array_t *a);
+int array_load(const char *filename, array_t *a);
+
+#endif /* _ARRAY_H_ */
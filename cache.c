@@ -0,0 +1,213 @@
+/** @file cache.c
+ *  @brief On-disk cache of rendered streams
+ *
+ *  Each stream is a file named after a 64-bit key - a hash of everything
+ *  that went into rendering it - holding a short header and the samples as
+ *  they are in memory. Files are written under a temporary name and renamed
+ *  into place, so a run that's interrupted, or several running at once,
+ *  never leave a partial file under a real key.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "file.h"
+
+#define CACHE_DIR_ENV "GEN_CACHE_DIR"
+#define CACHE_MAGIC "GENCACHE"
+
+struct cache_header {
+	char magic[8];
+	uint64_t key;
+	uint64_t len;
+	uint32_t sample_size;
+	uint32_t pad;
+};
+
+/** @brief Adds data to a hash
+ *  @param key Hash so far; CACHE_KEY_INIT to start
+ *  @param data Data to add
+ *  @param len Length of data, in bytes
+ *  @return New hash
+ *
+ *  64-bit FNV-1a - not cryptographic, just enough to tell renders apart.
+ */
+uint64_t cache_hash(uint64_t key, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		key ^= p[i];
+		key *= 0x100000001b3ULL;
+	}
+
+	return key;
+}
+
+/** @brief Finds the cache directory
+ *  @param buf Output; directory name
+ *  @param size Size of `buf`
+ *  @return 0 on success, negative if there is nowhere to put the cache
+ *
+ *  The cache lives in $GEN_CACHE_DIR, or else $XDG_CACHE_HOME/gen or
+ *  ~/.cache/gen, which is created if it doesn't exist.
+ */
+int cache_dir(char *buf, size_t size)
+{
+	return file_cache_dir(CACHE_DIR_ENV, "gen", buf, size);
+}
+
+/** @brief Maps a cached stream, if there is one
+ *  @param dir Cache directory
+ *  @param key Key of stream
+ *  @param len Number of samples expected
+ *  @param out Output; mapped stream
+ *  @return 0 on success, negative if the stream isn't cached
+ *
+ *  A file with the right name but the wrong contents is treated as missing.
+ */
+int cache_load(const char *dir, uint64_t key, size_t len, cache_map_t *out)
+{
+	char path[512];
+	struct stat st;
+	const struct cache_header *hdr;
+	size_t map_len = sizeof(*hdr) + len * sizeof(real_t);
+	void *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)key);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size != map_len) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	hdr = map;
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) || hdr->key != key ||
+	    hdr->len != len || hdr->sample_size != sizeof(real_t)) {
+		munmap(map, map_len);
+		return -1;
+	}
+
+	out->data = (const real_t *)(hdr + 1);
+	out->len = len;
+	out->map = map;
+	out->map_len = map_len;
+	return 0;
+}
+
+/** @brief Starts writing a stream to the cache
+ *  @param w Writer to initialize
+ *  @param dir Cache directory
+ *  @param key Key of stream
+ *  @return 0 on success, negative on failure
+ *
+ *  The stream only appears under its key once `cache_writer_close` succeeds.
+ */
+int cache_writer_open(cache_writer_t *w, const char *dir, uint64_t key)
+{
+	struct cache_header hdr = { .key = key, .sample_size = sizeof(real_t) };
+
+	memset(w, 0, sizeof(*w));
+	w->key = key;
+	snprintf(w->path, sizeof(w->path), "%s/%016llx", dir, (unsigned long long)key);
+	snprintf(w->tmp, sizeof(w->tmp), "%s.%d.tmp", w->path, (int)getpid());
+
+	w->fd = open(w->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (w->fd < 0) {
+		fprintf(stderr, "%s: can't create: %s\n", w->tmp, strerror(errno));
+		return -1;
+	}
+
+	/* the length is filled in by `cache_writer_close` */
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	if (file_write_all(w->fd, &hdr, sizeof(hdr), -1) < 0) {
+		fprintf(stderr, "%s: can't write: %s\n", w->tmp, strerror(errno));
+		close(w->fd);
+		unlink(w->tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** @brief Appends samples to a stream being cached
+ *  @param w Writer
+ *  @param data Samples
+ *  @param n Number of samples
+ *  @return 0 on success, negative on failure
+ *
+ *  After a failure later appends are ignored, and `cache_writer_close`
+ *  throws the stream away.
+ */
+int cache_writer_append(cache_writer_t *w, const real_t *data, size_t n)
+{
+	if (w->failed) {
+		return -1;
+	}
+	if (file_write_all(w->fd, data, n * sizeof(data[0]), -1) < 0) {
+		fprintf(stderr, "%s: can't write: %s\n", w->tmp, strerror(errno));
+		w->failed = 1;
+		return -1;
+	}
+
+	w->len += n;
+	return 0;
+}
+
+/** @brief Finishes writing a stream and puts it in the cache
+ *  @param w Writer
+ *  @return 0 on success, negative on failure
+ */
+int cache_writer_close(cache_writer_t *w)
+{
+	uint64_t len = w->len;
+
+	if (!w->failed &&
+	    file_write_all(w->fd, &len, sizeof(len), offsetof(struct cache_header, len)) < 0) {
+		fprintf(stderr, "%s: can't write: %s\n", w->tmp, strerror(errno));
+		w->failed = 1;
+	}
+	if (close(w->fd) < 0) {
+		w->failed = 1;
+	}
+	if (!w->failed && rename(w->tmp, w->path) < 0) {
+		fprintf(stderr, "%s: can't rename: %s\n", w->tmp, strerror(errno));
+		w->failed = 1;
+	}
+
+	if (w->failed) {
+		unlink(w->tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/** @brief Unmaps a stream mapped by `cache_load`
+ *  @param map Stream to unmap
+ */
+void cache_unmap(cache_map_t *map)
+{
+	if (map->map != NULL) {
+		munmap(map->map, map->map_len);
+	}
+	map->map = NULL;
+	map->data = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "globals.h"
+
+#define CACHE_KEY_INIT 0xcbf29ce484222325ULL /* FNV-1a offset basis */
+
+/* a cached stream, mapped read-only */
+typedef struct {
+	const real_t *data;
+	size_t len;
+	void *map;
+	size_t map_len;
+} cache_map_t;
+
+/* a stream being written to the cache, a block at a time */
+typedef struct {
+	int fd;
+	uint64_t key;
+	size_t len;      /* samples written so far */
+	int failed;
+	char path[512];  /* where it goes when done */
+	char tmp[544];   /* where it's written until then */
+} cache_writer_t;
+
+uint64_t cache_hash(uint64_t key, const void *data, size_t len);
+int cache_dir(char *buf, size_t size);
+int cache_load(const char *dir, uint64_t key, size_t len, cache_map_t *out);
+void cache_unmap(cache_map_t *map);
+int cache_writer_open(cache_writer_t *w, const char *dir, uint64_t key);
+int cache_writer_append(cache_writer_t *w, const real_t *data, size_t n);
+int cache_writer_close(cache_writer_t *w);
+
+#endif /* _CACHE_H_ */
@@ -0,0 +1,235 @@
+/** @file conv.c
+ *  @brief Uniformly partitioned FFT convolution
+ *
+ *  A long filter is cut into partitions of `part` taps, each transformed
+ *  once. Every block of `part` input samples is transformed once too, and
+ *  kept in a frequency-domain delay line; the output block is then the
+ *  inverse transform of the sum over partitions of each partition's
+ *  spectrum times the spectrum of the input block that many blocks ago
+ *  (overlap-save). The cost per sample grows with the number of partitions
+ *  only through multiply-adds, not transforms, and the latency is one
+ *  block.
+ *
+ *  The filter can be swapped between blocks; the block where that happens
+ *  is run through both and crossfaded, so a filter that changes over time
+ *  doesn't click.
+ *
+ *  Plans are made once per partition length and shared; each `conv_t` runs
+ *  them on its own buffers, so any number of threads can use one plan.
+ */
+
+#include <string.h>
+
+#include "conv.h"
+
+#ifndef USE_DOUBLE
+#define fftw_plan_dft_r2c_1d fftwf_plan_dft_r2c_1d
+#define fftw_plan_dft_c2r_1d fftwf_plan_dft_c2r_1d
+#define fftw_execute_dft_r2c fftwf_execute_dft_r2c
+#define fftw_execute_dft_c2r fftwf_execute_dft_c2r
+#define fftw_destroy_plan fftwf_destroy_plan
+#define fftw_alloc_real fftwf_alloc_real
+#define fftw_alloc_complex fftwf_alloc_complex
+#define fftw_free fftwf_free
+#endif
+
+/** @brief Plans the transforms for a partition length
+ *  @param p Plans to initialize
+ *  @param part Partition length
+ *  @return 0 on success, negative on failure
+ *
+ *  Not thread-safe, like the FFTW planner.
+ */
+int conv_plan_init(conv_plan_t *p, int part)
+{
+	real_t *real = fftw_alloc_real(2 * part);
+	conv_complex_t *cplx = fftw_alloc_complex(part + 1);
+
+	p->fwd = p->inv = NULL;
+	if (real != NULL && cplx != NULL) {
+		p->part = part;
+		p->fwd = fftw_plan_dft_r2c_1d(2 * part, real, cplx, FFTW_MEASURE);
+		p->inv = fftw_plan_dft_c2r_1d(2 * part, cplx, real, FFTW_MEASURE);
+	}
+	fftw_free(real);
+	fftw_free(cplx);
+
+	if (p->fwd == NULL || p->inv == NULL) {
+		conv_plan_free(p);
+		return -1;
+	}
+	return 0;
+}
+
+/** @brief Frees the transforms for a partition length
+ *  @param p Plans to free
+ */
+void conv_plan_free(conv_plan_t *p)
+{
+	if (p->fwd != NULL) {
+		fftw_destroy_plan(p->fwd);
+	}
+	if (p->inv != NULL) {
+		fftw_destroy_plan(p->inv);
+	}
+	p->fwd = p->inv = NULL;
+}
+
+/** @brief Sets up a convolution
+ *  @param c Convolution to initialize
+ *  @param p Plans for the partition length, must outlive `c`
+ *  @param n_parts Number of filter partitions
+ *  @return 0 on success, negative on failure
+ */
+int conv_init(conv_t *c, const conv_plan_t *p, int n_parts)
+{
+	int stride = (p->part + 1 + 3) & ~3;
+	size_t spectra = (size_t)n_parts * stride;
+
+	memset(c, 0, sizeof(*c));
+	c->plan = p;
+	c->n_parts = n_parts;
+	c->bins = p->part + 1;
+	c->stride = stride;
+	c->fdl = fftw_alloc_complex(spectra);
+	c->filt = fftw_alloc_complex(spectra);
+	c->next = fftw_alloc_complex(spectra);
+	c->spec = fftw_alloc_complex(c->bins);
+	c->buf = fftw_alloc_real(2 * p->part);
+	c->y = fftw_alloc_real(p->part);
+	c->in = fftw_alloc_real(2 * p->part);
+	if (c->fdl == NULL || c->filt == NULL || c->next == NULL || c->spec == NULL ||
+	    c->buf == NULL || c->y == NULL || c->in == NULL) {
+		conv_free(c);
+		return -1;
+	}
+
+	conv_reset(c);
+	return 0;
+}
+
+/** @brief Frees a convolution
+ *  @param c Convolution to free
+ */
+void conv_free(conv_t *c)
+{
+	fftw_free(c->fdl);
+	fftw_free(c->filt);
+	fftw_free(c->next);
+	fftw_free(c->spec);
+	fftw_free(c->buf);
+	fftw_free(c->y);
+	fftw_free(c->in);
+	memset(c, 0, sizeof(*c));
+}
+
+/** @brief Forgets the input so far and the filter, to start a new stream
+ *  @param c Convolution to reset
+ */
+void conv_reset(conv_t *c)
+{
+	memset(c->fdl, 0, (size_t)c->n_parts * c->stride * sizeof(c->fdl[0]));
+	memset(c->in, 0, 2 * c->plan->part * sizeof(c->in[0]));
+	c->head = 0;
+	c->have_filt = c->have_next = 0;
+}
+
+/** @brief Sets the filter
+ *  @param c Convolution
+ *  @param h Filter, n_parts * part taps
+ *
+ *  The first filter after `conv_reset` applies from the next block on;
+ *  after that, the next block crossfades from the old filter to this one.
+ */
+void conv_set_filter(conv_t *c, const real_t *h)
+{
+	int part = c->plan->part;
+	real_t scale = 1.0 / (2 * part); /* FFTW doesn't normalize */
+	conv_complex_t *dst = c->have_filt ? c->next : c->filt;
+
+	for (int k = 0; k < c->n_parts; k++) {
+		for (int i = 0; i < part; i++) {
+			c->buf[i] = h[(size_t)k * part + i] * scale;
+		}
+		memset(c->buf + part, 0, part * sizeof(c->buf[0]));
+		fftw_execute_dft_r2c(c->plan->fwd, c->buf, dst + (size_t)k * c->stride);
+	}
+
+	if (c->have_filt) {
+		c->have_next = 1;
+	}
+	c->have_filt = 1;
+}
+
+/** @brief Sums the products of the delay line with a filter
+ *  @param c Convolution
+ *  @param filt Filter spectra
+ *  @param out Output; `part` samples of filtered input
+ */
+static void filter_block(conv_t *c, const conv_complex_t *filt, real_t *out)
+{
+	int part = c->plan->part, bins = c->bins;
+	real_t *acc = (real_t *)c->spec;
+
+	memset(c->spec, 0, bins * sizeof(c->spec[0]));
+	for (int k = 0; k < c->n_parts; k++) {
+		int slot = (c->head - k + c->n_parts) % c->n_parts;
+		const real_t *x = (const real_t *)(c->fdl + (size_t)slot * c->stride);
+		const real_t *h = (const real_t *)(filt + (size_t)k * c->stride);
+
+		/* interleaved complex multiply-add, spelled out so it vectorizes */
+		for (int b = 0; b < 2 * bins; b += 2) {
+			acc[b] += x[b] * h[b] - x[b + 1] * h[b + 1];
+			acc[b + 1] += x[b] * h[b + 1] + x[b + 1] * h[b];
+		}
+	}
+
+	/* overlap-save: the first half has wrapped around */
+	fftw_execute_dft_c2r(c->plan->inv, c->spec, c->buf);
+	memcpy(out, c->buf + part, part * sizeof(out[0]));
+}
+
+/** @brief Runs one block of input through the filter
+ *  @param c Convolution
+ *  @param in `part` input samples
+ *  @param out Output; `part` filtered samples are added here
+ *
+ *  Without a filter, the input is only remembered.
+ */
+void conv_block(conv_t *c, const real_t *in, real_t *out)
+{
+	int part = c->plan->part;
+	real_t *y = c->y;
+
+	memmove(c->in, c->in + part, part * sizeof(c->in[0]));
+	memcpy(c->in + part, in, part * sizeof(c->in[0]));
+	c->head = (c->head + 1) % c->n_parts;
+	fftw_execute_dft_r2c(c->plan->fwd, c->in, c->fdl + (size_t)c->head * c->stride);
+
+	if (!c->have_filt) {
+		return;
+	}
+
+	if (!c->have_next) {
+		filter_block(c, c->filt, y);
+		for (int i = 0; i < part; i++) {
+			out[i] += y[i];
+		}
+		return;
+	}
+
+	/* crossfade linearly from the old filter to the new one */
+	filter_block(c, c->filt, y);
+	for (int i = 0; i < part; i++) {
+		out[i] += y[i] * (part - i - 0.5) / part;
+	}
+	filter_block(c, c->next, y);
+	for (int i = 0; i < part; i++) {
+		out[i] += y[i] * (i + 0.5) / part;
+	}
+
+	conv_complex_t *tmp = c->filt;
+	c->filt = c->next;
+	c->next = tmp;
+	c->have_next = 0;
+}
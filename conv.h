@@ -0,0 +1,48 @@
+#ifndef _CONV_H_
+#define _CONV_H_
+
+#include <complex.h>
+#include <fftw3.h>
+
+#include "globals.h"
+
+#ifndef USE_DOUBLE
+typedef fftwf_plan conv_fftw_plan_t;
+typedef fftwf_complex conv_complex_t;
+#else
+typedef fftw_plan conv_fftw_plan_t;
+typedef fftw_complex conv_complex_t;
+#endif
+
+/* transforms shared by every `conv_t` with the same partition length */
+typedef struct {
+	int part;                   /* partition length */
+	conv_fftw_plan_t fwd, inv;  /* 2 * part points */
+} conv_plan_t;
+
+/* uniformly partitioned convolution of one stream with a changeable filter */
+typedef struct {
+	const conv_plan_t *plan;
+	int n_parts;
+	int bins;              /* part + 1 */
+	int stride;            /* spacing of spectra, a multiple of 4 bins to keep alignment */
+	conv_complex_t *fdl;   /* spectra of the last n_parts input blocks */
+	conv_complex_t *filt;  /* current filter, n_parts spectra */
+	conv_complex_t *next;  /* filter to crossfade to, n_parts spectra */
+	conv_complex_t *spec;  /* scratch, one spectrum */
+	real_t *buf;           /* scratch, 2 * part samples */
+	real_t *y;             /* scratch, part samples */
+	real_t *in;            /* last 2 * part input samples */
+	int head;              /* newest spectrum in `fdl` */
+	int have_filt, have_next;
+} conv_t;
+
+int conv_plan_init(conv_plan_t *p, int part);
+void conv_plan_free(conv_plan_t *p);
+int conv_init(conv_t *c, const conv_plan_t *p, int n_parts);
+void conv_free(conv_t *c);
+void conv_reset(conv_t *c);
+void conv_set_filter(conv_t *c, const real_t *h);
+void conv_block(conv_t *c, const real_t *in, real_t *out);
+
+#endif /* _CONV_H_ */
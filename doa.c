@@ -0,0 +1,201 @@
+/** @file doa.c
+ *  @brief Direction of arrival of far-away sources
+ *
+ *  From far enough away a source's wavefronts are flat, so the difference in
+ *  its distance to two mics only depends on the direction it's in: it's the
+ *  projection of the vector between the mics on that direction. That gives a
+ *  lag per pair per direction, tabulated once like `field_t`'s, and a scan
+ *  over a few hundred directions instead of tens of thousands of cells.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "doa.h"
+#include "vector.h"
+
+#define DEG (M_PI / 180.0)
+
+/** @brief Works out the azimuth and elevation of a direction on the grid
+ *  @param d Grid
+ *  @param r Elevation index
+ *  @param i Azimuth index
+ *  @param az Output; azimuth, in degrees
+ *  @param el Output; elevation, in degrees
+ */
+static void doa_angles(const doa_t *d, int r, int i, real_t *az, real_t *el)
+{
+	*az = d->az_step * i;
+	*el = d->n_el > 1 ? d->el_lo + d->el_step * r : 0.0;
+}
+
+/** @brief Works out the unit vector towards a direction
+ *  @param az Azimuth, in degrees
+ *  @param el Elevation, in degrees
+ *  @return Unit vector
+ */
+static vec3_t doa_dir(real_t az, real_t el)
+{
+	double a = az * DEG, e = el * DEG;
+
+	return (vec3_t){ cos(e) * cos(a), cos(e) * sin(a), sin(e) };
+}
+
+/** @brief Initializes a direction-of-arrival grid
+ *  @param d Grid to initialize
+ *  @param az_step Degrees between azimuths, rounded to fit the circle
+ *  @param el_step Degrees between elevations, rounded to fit, or 0 for
+ *                 level directions only
+ *  @param array Mic positions and channel delays
+ *  @param pairs Mic pair of each cross-correlation row
+ *  @param n_pairs Number of mic pairs
+ *  @param xcor_len Length of each cross-correlation row
+ *  @param samples_per_m Cross-correlation samples per meter of path difference
+ *  @return 0 on success, negative on failure
+ *
+ *  A source in direction u is |s - p| ~ |s| - p.u from a mic at p, so a
+ *  pair's lag is (p_b - p_a).u, plus the difference in the channels' delays,
+ *  rounded and clamped like `field_t`'s. A flat array can't tell a source
+ *  above it from its reflection below, so then only elevations from 0 to 90
+ *  degrees are scanned; otherwise from -90.
+ */
+int doa_init(doa_t *d, real_t az_step, real_t el_step, const array_t *array,
+             const locate_pair_t *pairs, int n_pairs, int xcor_len, real_t samples_per_m)
+{
+	int half = xcor_len / 2, last = xcor_len - 1 - half, flat = 1;
+	int n_az = (int)(360.0 / az_step + 0.5), n_el = 1;
+
+	for (int m = 1; m < array->n_mics; m++) {
+		flat = flat && array->pos[m].z == array->pos[0].z;
+	}
+	d->el_lo = flat ? 0.0 : -90.0;
+	if (el_step > 0.0) {
+		n_el = (int)((90.0 - d->el_lo) / el_step + 0.5) + 1;
+	}
+
+	d->n_az = n_az;
+	d->n_el = n_el;
+	d->az_step = n_az > 0 ? 360.0 / n_az : 0.0;
+	d->el_step = n_el > 1 ? (90.0 - d->el_lo) / (n_el - 1) : 0.0;
+	d->n_pairs = n_pairs;
+	d->xcor_len = xcor_len;
+	d->lags = NULL;
+
+	/* lags are stored as 16 bits */
+	if (n_az < 1 || xcor_len > INT16_MAX + 1) {
+		return -1;
+	}
+
+	d->lags = malloc((size_t)n_pairs * n_el * n_az * sizeof(d->lags[0]));
+	if (d->lags == NULL) {
+		return -1;
+	}
+
+	for (int r = 0; r < n_el; r++) {
+		for (int i = 0; i < n_az; i++) {
+			real_t az, el, dist[ARRAY_MICS_MAX];
+			vec3_t u;
+
+			doa_angles(d, r, i, &az, &el);
+			u = doa_dir(az, el);
+
+			for (int m = 0; m < array->n_mics; m++) {
+				vec3_t p = array->pos[m];
+				real_t late = array->delay[m] * SND_SPEED * samples_per_m;
+				dist[m] = -(p.x * u.x + p.y * u.y + p.z * u.z) * samples_per_m + late;
+			}
+			for (int p = 0; p < n_pairs; p++) {
+				real_t dd = dist[pairs[p].a] - dist[pairs[p].b];
+				int ds = (int)(dd + (dd < 0.0 ? -0.5 : 0.5));
+				d->lags[((size_t)p * n_el + r) * n_az + i] =
+					half + (ds < -half ? -half : ds > last ? last : ds);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/** @brief Frees memory allocated by `doa_init`
+ *  @param d Grid to free
+ */
+void doa_free(doa_t *d)
+{
+	free(d->lags);
+	d->lags = NULL;
+}
+
+/** @brief Evaluates every direction
+ *  @param d Grid
+ *  @param xcor Cross-correlation rows from `locate_xcor`
+ *  @param map Output; n_el * n_az values, lowest elevation first
+ *
+ *  For each direction, sums the (clamped) cross-correlation of each mic pair
+ *  at the direction's lag from the table.
+ */
+void doa_scan(const doa_t *d, const real_t *xcor, real_t *map)
+{
+	size_t n = (size_t)d->n_el * d->n_az;
+
+	memset(map, 0, n * sizeof(map[0]));
+	for (int p = 0; p < d->n_pairs; p++) {
+		const real_t *row = xcor + (size_t)d->xcor_len * p;
+		const int16_t *lag = d->lags + n * p;
+
+		for (size_t i = 0; i < n; i++) {
+			real_t v = row[lag[i]];
+			map[i] += v < 0.0 ? 0.0 : v > 1.0 ? 1.0 : v;
+		}
+	}
+}
+
+/** @brief Finds the best directions
+ *  @param d Grid
+ *  @param map Output of `doa_scan`
+ *  @param n_peaks Maximum number of peaks to find
+ *  @param min_sep Minimum angle between peaks, in degrees
+ *  @param peaks Output; peaks in decreasing order of score
+ *  @return Number of peaks found
+ */
+int doa_peaks(const doa_t *d, const real_t *map, int n_peaks, real_t min_sep, doa_peak_t *peaks)
+{
+	real_t min_cos = cos(min_sep * DEG);
+	int n;
+
+	for (n = 0; n < n_peaks; n++) {
+		int best = -1;
+
+		for (int r = 0; r < d->n_el; r++) {
+			for (int i = 0; i < d->n_az; i++) {
+				int at = r * d->n_az + i;
+				if (best >= 0 && map[at] <= map[best]) {
+					continue;
+				}
+
+				/* skip directions too close to peaks already found */
+				real_t az, el;
+				doa_angles(d, r, i, &az, &el);
+				vec3_t u = doa_dir(az, el);
+				int k;
+				for (k = 0; k < n; k++) {
+					vec3_t f = doa_dir(peaks[k].az, peaks[k].el);
+					if (u.x * f.x + u.y * f.y + u.z * f.z > min_cos) {
+						break;
+					}
+				}
+				if (k == n) {
+					best = at;
+				}
+			}
+		}
+
+		if (best < 0) {
+			break;
+		}
+		doa_angles(d, best / d->n_az, best % d->n_az, &peaks[n].az, &peaks[n].el);
+		peaks[n].score = map[best];
+	}
+
+	return n;
+}
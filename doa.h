@@ -0,0 +1,34 @@
+#ifndef _DOA_H_
+#define _DOA_H_
+
+#include <stdint.h>
+
+#include "array.h"
+#include "globals.h"
+#include "locate.h"
+
+/* far-field steered-response power over a grid of directions: azimuth
+ * counterclockwise from the x axis, elevation up from the array's plane
+ */
+typedef struct {
+	int n_az, n_el;             /* grid size; n_el 1 for azimuth only, level */
+	real_t az_step, el_step;    /* degrees */
+	real_t el_lo;               /* lowest elevation, -90 or 0 degrees */
+	int n_pairs;
+	int xcor_len;               /* length of each cross-correlation row */
+	int16_t *lags;              /* n_pairs * n_el * n_az indices into each pair's
+	                               cross-correlation row, lowest elevation first */
+} doa_t;
+
+typedef struct {
+	real_t az, el;              /* degrees */
+	real_t score;
+} doa_peak_t;
+
+int doa_init(doa_t *d, real_t az_step, real_t el_step, const array_t *array, const locate_pair_t *pairs,
+             int n_pairs, int xcor_len, real_t samples_per_m);
+void doa_free(doa_t *d);
+void doa_scan(const doa_t *d, const real_t *xcor, real_t *map);
+int doa_peaks(const doa_t *d, const real_t *map, int n_peaks, real_t min_sep, doa_peak_t *peaks);
+
+#endif /* _DOA_H_ */
@@ -0,0 +1,205 @@
+/** @file field.c
+ *  @brief CPU evaluation of the steered-response power field
+ *
+ *  Does the same thing as `shaders/field.frag`, but on the CPU and for a
+ *  caller-specified band of rows at a time so that it can be split among
+ *  threads.
+ *
+ *  Which lag of each pair's cross-correlation lands in which cell only
+ *  depends on the array and the grid, so it's worked out once, into a table
+ *  that `view` also hands to the shader; each frame is then just lookups and
+ *  adds.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "field.h"
+
+/** @brief Works out the cross-correlation lag of each pair at each cell
+ *  @param f Field, with everything but the tables set up
+ *  @param array Mic positions and channel delays
+ *  @param pairs Mic pair of each cross-correlation row
+ *  @param samples_per_m Cross-correlation samples per meter of path difference
+ *  @return 0 on success, negative on failure
+ *
+ *  A cell's lag for a pair is the difference in its distance to the two
+ *  mics, plus the difference in their channels' delays, rounded to a sample
+ *  and clamped to the row. Distances are computed one row at a time per mic
+ *  so the square roots vectorize.
+ */
+static int field_lags(field_t *f, const array_t *array, const locate_pair_t *pairs,
+                      real_t samples_per_m)
+{
+	int xres = f->xres, yres = f->yres, half = f->xcor_len / 2, last = f->xcor_len - 1 - half;
+	real_t step_x = f->width / (real_t)xres, step_y = f->height / (real_t)yres;
+	real_t x0 = -f->width * 0.5 + step_x * 0.5;
+
+	real_t *delay = malloc((size_t)array->n_mics * xres * sizeof(delay[0]));
+	if (delay == NULL) {
+		return -1;
+	}
+
+	for (int r = 0; r < yres; r++) {
+		real_t y = f->height * 0.5 - step_y * ((real_t)r + 0.5);
+
+		/* distance from each mic to each cell in the row, in samples */
+		for (int m = 0; m < array->n_mics; m++) {
+			vec3_t p = array->pos[m];
+			real_t *d = delay + m * xres;
+			real_t dyz = (y - p.y) * (y - p.y) + p.z * p.z;
+			real_t late = array->delay[m] * SND_SPEED * samples_per_m;
+
+			for (int i = 0; i < xres; i++) {
+				real_t dx = x0 + step_x * (real_t)i - p.x;
+				d[i] = sqrt(dx * dx + dyz) * samples_per_m + late;
+			}
+		}
+
+		for (int p = 0; p < f->n_pairs; p++) {
+			int16_t *lag = f->lags + ((size_t)p * yres + r) * xres;
+			real_t *d0 = delay + pairs[p].a * xres, *d1 = delay + pairs[p].b * xres;
+
+			for (int i = 0; i < xres; i++) {
+				/* round half away from zero, like round(), without the libm call */
+				real_t dd = d0[i] - d1[i];
+				int ds = (int)(dd + (dd < 0.0 ? -0.5 : 0.5));
+				lag[i] = half + (ds < -half ? -half : ds > last ? last : ds);
+			}
+		}
+	}
+
+	free(delay);
+	return 0;
+}
+
+/** @brief Initializes a field
+ *  @param f Field to initialize
+ *  @param xres Number of cells in x direction
+ *  @param yres Number of cells in y direction
+ *  @param width Width of field, in meters
+ *  @param height Height of field, in meters
+ *  @param array Mic positions and channel delays
+ *  @param pairs Mic pair of each cross-correlation row
+ *  @param n_pairs Number of mic pairs
+ *  @param xcor_len Length of each cross-correlation row
+ *  @param samples_per_m Cross-correlation samples per meter of path difference
+ *  @return 0 on success, negative on failure
+ */
+int field_init(field_t *f, int xres, int yres, real_t width, real_t height,
+               const array_t *array, const locate_pair_t *pairs, int n_pairs,
+               int xcor_len, real_t samples_per_m)
+{
+	f->xres = xres;
+	f->yres = yres;
+	f->width = width;
+	f->height = height;
+	f->n_pairs = n_pairs;
+	f->xcor_len = xcor_len;
+
+	/* lags are stored as 16 bits */
+	if (xcor_len > INT16_MAX + 1) {
+		return -1;
+	}
+
+	f->map = calloc((size_t)xres * yres, sizeof(f->map[0]));
+	f->lags = malloc((size_t)n_pairs * xres * yres * sizeof(f->lags[0]));
+	if (f->map == NULL || f->lags == NULL || field_lags(f, array, pairs, samples_per_m) < 0) {
+		field_free(f);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** @brief Frees memory allocated by `field_init`
+ *  @param f Field to free
+ */
+void field_free(field_t *f)
+{
+	free(f->map);
+	free(f->lags);
+	f->map = NULL;
+	f->lags = NULL;
+}
+
+/** @brief Evaluates a band of rows of the field
+ *  @param f Field to evaluate
+ *  @param xcor Cross-correlation rows from `locate_xcor`
+ *  @param row_start First row to evaluate
+ *  @param row_end One past the last row to evaluate
+ *
+ *  For each cell, sums the (clamped) cross-correlation of each mic pair at
+ *  the cell's lag from the table.
+ */
+void field_rows(field_t *f, const real_t *xcor, int row_start, int row_end)
+{
+	int xres = f->xres;
+
+	for (int r = row_start; r < row_end; r++) {
+		real_t *dst = f->map + (size_t)r * xres;
+
+		memset(dst, 0, xres * sizeof(dst[0]));
+		for (int p = 0; p < f->n_pairs; p++) {
+			const real_t *row = xcor + (size_t)f->xcor_len * p;
+			const int16_t *lag = f->lags + ((size_t)p * f->yres + r) * xres;
+
+			for (int i = 0; i < xres; i++) {
+				real_t v = row[lag[i]];
+				dst[i] += v < 0.0 ? 0.0 : v > 1.0 ? 1.0 : v;
+			}
+		}
+	}
+}
+
+/** @brief Finds the highest peaks in the field
+ *  @param f Field to search
+ *  @param n_peaks Maximum number of peaks to find
+ *  @param radius Minimum distance between peaks, in meters
+ *  @param peaks Output; peaks in decreasing order of score
+ *  @return Number of peaks found
+ */
+int field_peaks(const field_t *f, int n_peaks, real_t radius, field_peak_t *peaks)
+{
+	real_t step_x = f->width / (real_t)f->xres, step_y = f->height / (real_t)f->yres;
+	real_t r2 = radius * radius;
+	int n;
+
+	for (n = 0; n < n_peaks; n++) {
+		field_peak_t best = { .score = -1.0 };
+
+		for (int r = 0; r < f->yres; r++) {
+			real_t y = f->height * 0.5 - step_y * ((real_t)r + 0.5);
+			const real_t *row = f->map + (size_t)r * f->xres;
+
+			for (int i = 0; i < f->xres; i++) {
+				if (row[i] <= best.score) {
+					continue;
+				}
+
+				/* skip cells too close to peaks already found */
+				real_t x = -f->width * 0.5 + step_x * ((real_t)i + 0.5);
+				int k;
+				for (k = 0; k < n; k++) {
+					real_t dx = x - peaks[k].x, dy = y - peaks[k].y;
+					if (dx * dx + dy * dy < r2) {
+						break;
+					}
+				}
+				if (k == n) {
+					best.x = x;
+					best.y = y;
+					best.score = row[i];
+				}
+			}
+		}
+
+		if (best.score < 0.0) {
+			break;
+		}
+		peaks[n] = best;
+	}
+
+	return n;
+}
@@ -0,0 +1,34 @@
+#ifndef _FIELD_H_
+#define _FIELD_H_
+
+#include <stdint.h>
+
+#include "array.h"
+#include "globals.h"
+#include "locate.h"
+#include "vector.h"
+
+/* steered-response power field over a rectangular grid centered on (0,0) */
+typedef struct {
+	int xres, yres;             /* grid size, in cells */
+	real_t width, height;       /* grid extent, in meters */
+	int n_pairs;
+	int xcor_len;               /* length of each cross-correlation row */
+	int16_t *lags;              /* n_pairs * yres * xres indices into each pair's
+	                               cross-correlation row, top row first */
+	real_t *map;                /* xres * yres field values, top row first */
+} field_t;
+
+typedef struct {
+	real_t x, y, z;
+	real_t score;
+} field_peak_t;
+
+int field_init(field_t *f, int xres, int yres, real_t width, real_t height,
+               const array_t *array, const locate_pair_t *pairs, int n_pairs,
+               int xcor_len, real_t samples_per_m);
+void field_free(field_t *f);
+void field_rows(field_t *f, const real_t *xcor, int row_start, int row_end);
+int field_peaks(const field_t *f, int n_peaks, real_t radius, field_peak_t *peaks);
+
+#endif /* _FIELD_H_ */
@@ -1,5 +1,5 @@
 /** @file file.c
- *  @brief File reading stuff
+ *  @brief File reading and writing stuff
  */
 
 #include <errno.h>
@@ -60,3 +60,68 @@ void file_free(void *file_data)
 {
 	free(file_data);
 }
+
+/** @brief Finds a per-user cache directory, creating it if needed
+ *  @param env Environment variable that overrides the directory
+ *  @param name Subdirectory of the usual cache location
+ *  @param buf Output; directory name
+ *  @param size Size of `buf`
+ *  @return 0 on success, negative if there is nowhere to put the cache
+ *
+ *  The directory is $`env`, or else $XDG_CACHE_HOME/`name` or
+ *  ~/.cache/`name`.
+ */
+int file_cache_dir(const char *env, const char *name, char *buf, size_t size)
+{
+	const char *dir = getenv(env), *home;
+	int len;
+
+	if (dir != NULL) {
+		len = snprintf(buf, size, "%s", dir);
+	} else if ((dir = getenv("XDG_CACHE_HOME")) != NULL) {
+		len = snprintf(buf, size, "%s/%s", dir, name);
+	} else if ((home = getenv("HOME")) != NULL) {
+		len = snprintf(buf, size, "%s/.cache", home);
+		if (len < size) {
+			mkdir(buf, 0777);
+		}
+		len = snprintf(buf, size, "%s/.cache/%s", home, name);
+	} else {
+		return -1;
+	}
+	if (len >= size) {
+		return -1;
+	}
+
+	if (mkdir(buf, 0777) < 0 && errno != EEXIST) {
+		return -1;
+	}
+	return 0;
+}
+
+/** @brief Writes all of a buffer to a file
+ *  @param fd File to write to
+ *  @param buf Data to write
+ *  @param len Number of bytes
+ *  @param offset Where to write, or negative for the current position
+ *  @return 0 on success, negative on failure
+ */
+int file_write_all(int fd, const void *buf, size_t len, off_t offset)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t ret = offset < 0 ? write(fd, p, len) : pwrite(fd, p, len, offset);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+		offset = offset < 0 ? offset : offset + ret;
+	}
+
+	return 0;
+}
@@ -1,7 +1,12 @@
 #ifndef _FILE_H_
 #define _FILE_H_
 
+#include <stddef.h>
+#include <sys/types.h>
+
 void *file_read(const char *filename, ssize_t *out);
 void file_free(void *file_data);
+int file_write_all(int fd, const void *buf, size_t len, off_t offset);
+int file_cache_dir(const char *env, const char *name, char *buf, size_t size);
 
 #endif /* _FILE_H */
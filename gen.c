@@ -2,265 +2,1170 @@
  *  @brief Program to generate simulated audio streams for `view`.
  */
 
+#include <complex.h>
+#include <fftw3.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "array.h"
+#include "cache.h"
+#include "conv.h"
 #include "globals.h"
 #include "liss.h"
+#include "pool.h"
+#include "resample.h"
+#include "room.h"
 #include "vector.h"
 #include "wav.h"
 
+#ifndef USE_DOUBLE
+#define fftw_plan fftwf_plan
+#define fftw_plan_dft_r2c_1d fftwf_plan_dft_r2c_1d
+#define fftw_plan_dft_c2r_1d fftwf_plan_dft_c2r_1d
+#define fftw_execute_dft_r2c fftwf_execute_dft_r2c
+#define fftw_execute_dft_c2r fftwf_execute_dft_c2r
+#define fftw_alloc_real fftwf_alloc_real
+#define fftw_alloc_complex fftwf_alloc_complex
+#define fftw_complex fftwf_complex
+#endif
+
 #define BASELINE_DIST 5.0 /* distance associated with base input stream, used for amplitude adjust */
-#define RESAMPLE_SIZE 31 /* width of sinc kernel (number of samples in each direction) */
+#define LOAD_CHUNK (1 << 20) /* samples converted per input loading job */
+#define TILE_LEN 4096 /* samples of every mic generated per job */
+#define CHUNK_LEN (64 * TILE_LEN) /* samples of every mic generated before writing them out */
+
+#define BLOCK_DEFAULT 128 /* hop of the FFT delay engine's blocks */
+#define BLOCK_MIN 16
+#define MAX_STEP_DEFAULT 0.1 /* delay change per block, in samples, before falling back to sinc */
+#define TAPER_MIN 16 /* shortest taper at the ends of an FFT block's input */
+#define CTL_MAX (TILE_LEN / BLOCK_MIN + 3) /* block centres a tile needs */
+
+#define ROOM_BETA_DEFAULT 0.7  /* wall reflection coefficient */
+#define RIR_MS_DEFAULT 300     /* length of room impulse responses */
+#define RIR_UPDATE_MS_DEFAULT 100 /* how often they follow the sources */
+#define RIR_PART 256           /* partition length for convolving with them */
+
+#define CACHE_VERSION 1 /* bump when rendering changes, to invalidate cached renders */
+
+enum { ENGINE_SINC, ENGINE_FFT };
+
+static array_t array;
+
+/* positions of a source, and its distance from the origin */
+struct track {
+	real_t x[TILE_LEN], y[TILE_LEN], z[TILE_LEN];
+	real_t d0[TILE_LEN];
+};
+
+/* scratch space for the FFT delay engine */
+struct fft_buf {
+	struct track ctl;                 /* source at each block centre */
+	real_t ds[ARRAY_MICS_MAX][CTL_MAX]; /* delay and gain at each block centre */
+	real_t amp[ARRAY_MICS_MAX][CTL_MAX];
+	real_t *in, *out;                 /* 4 blocks */
+	fftw_complex *spec, *shift;       /* 2 blocks + 1 bins */
+};
+
+/* scratch space for convolving with room impulse responses */
+struct reverb_buf {
+	real_t *rir;
+	real_t in[RIR_PART], out[RIR_PART];
+};
 
-#include "mic.c"
+/* convolution of one source for one mic, carried from chunk to chunk */
+struct reverb_state {
+	conv_t conv;
+	size_t next_update; /* sample at which to recompute the impulse response */
+};
 
+/* one chunk of output, generated by the workers while the one before it is
+ * written out by the I/O thread
+ */
+struct chunk {
+	size_t start, n;
+	int16_t *out;   /* CHUNK_LEN per mic */
+	real_t *render; /* CHUNK_LEN per mic, when rendering a source for the cache */
+};
+
+/* scratch space for generating one tile */
+struct tile_buf {
+	struct track path;                   /* source at each sample */
+	real_t ds[TILE_LEN], amp[TILE_LEN];  /* delay and gain at one mic */
+	real_t acc[ARRAY_MICS_MAX][TILE_LEN];
+	struct fft_buf *fft;                 /* NULL for the sinc engine */
+};
+
+/* output is generated in tiles of TILE_LEN samples of every mic, handed out
+ * to whichever worker is free; each source's trajectory is worked out once
+ * per tile and shared by all the mics. Tiles are grouped in chunks, which
+ * are written out as soon as they are done, so only two chunks of output are
+ * ever held at once
+ */
 struct {
-	atomic_int index;
 	int n_streams;
 	real_t **streams;
-	real_t *out_acc;
-	int16_t *out_samples;
-	char *file_prefix;
+	struct tile_buf *tiles; /* one per worker */
+	int src_lo, src_hi;     /* sources to render */
+	int paths;              /* LISS_PLANE or LISS_VOLUME */
+	cache_map_t (*cached)[ARRAY_MICS_MAX]; /* cached render of each source at each mic, or NULL */
+	cache_writer_t *caching; /* one per mic, when rendering a source for the cache */
+	wav_writer_t out[ARRAY_MICS_MAX];
+	struct chunk chunks[2];
+	struct chunk *chunk;    /* being generated */
+	atomic_int tiles_done;
+	int n_tiles;
 	size_t n_samples;
 	int32_t sample_rate;
-} param;
+	resampler_t resampler;
+
+	/* FFT delay engine */
+	int engine;
+	int block;            /* hop; blocks are twice this long */
+	real_t max_step;      /* largest delay change per block it handles */
+	real_t *taper;        /* input window, 4 blocks */
+	real_t *window;       /* output window, 2 blocks */
+	fftw_plan fwd, inv;   /* 4-block transforms */
+	atomic_int fallbacks; /* (mic, block) pairs done by `resample` instead */
+	atomic_int blocks;
+
+	/* room reflections */
+	room_t *room;             /* NULL for none */
+	size_t rir_len;           /* a multiple of RIR_PART */
+	size_t rir_update;        /* samples between impulse responses */
+	real_t rir_pre;           /* delay added to make them causal */
+	conv_plan_t conv_plan;
+	struct reverb_buf *reverbs; /* one per worker */
+	struct reverb_state *reverb_states; /* one per mic per source */
+	real_t *reverb;           /* CHUNK_LEN per mic */
+
+	/* background writing of finished chunks */
+	pthread_mutex_t io_lock;
+	pthread_cond_t io_cond;
+	struct chunk *io_chunk;   /* being written, or NULL */
+	int io_quit;
+} param = {
+	.io_lock = PTHREAD_MUTEX_INITIALIZER,
+	.io_cond = PTHREAD_COND_INITIALIZER,
+};
 
 /* input file shit */
 int input_n_files;
 real_t **input_streams;
 
-/** @brief Generates an interpolated sample at a given base plus delay
- *  @param data Audio input data to sample
- *  @param len Length of input data
- *  @param base Base sample offset
- *  @param ds Delay from base to sample at (in samples)
- *  @return The interpolated sample at data[base + ds]
- *
- *  Uses a rectangular windowed sinc with RESAMPLE_SIZE * 2 samples. Maybe it
- *  should be windowed better but in practice it doesn't matter much when the
- *  kernel is wide enough. It's not for audiophiles anyway.
+/** @brief Works out where a source is over part of a tile
+ *  @param liss_idx Index of lissajous path parameters to use
+ *  @param rate Sample rate, in Hz
+ *  @param start First sample, may be negative
+ *  @param step Samples between positions
+ *  @param n Number of positions
+ *  @param t Output; trajectory and distance from the origin
  */
-static real_t resample(real_t *data, size_t len, size_t base, real_t ds)
+static void gen_trajectory(int liss_idx, real_t rate, ptrdiff_t start, ptrdiff_t step, size_t n,
+                           struct track *t)
 {
-	real_t dsi = floor(ds), dsf = dsi + 1.0 - ds;
-	real_t sin_dsf = sin(dsf * M_PI) / M_PI, acc = 0.0;
-	ssize_t off = (ssize_t)dsi + base;
+	real_t irate = 1.0 / rate;
 
-	if (sin_dsf == 0.0) {
-		return off >= 0 && off < len ? data[off] : 0.0;
+	for (size_t i = 0; i < n; i++) {
+		vec3_t source_pos = liss_pos((real_t)(start + (ptrdiff_t)i * step) * irate, param.paths, liss_idx);
+		t->x[i] = source_pos.x;
+		t->y[i] = source_pos.y;
+		t->z[i] = source_pos.z;
+		t->d0[i] = vec3_dist(source_pos, vec3_zero);
 	}
+}
 
-	for (ssize_t i = -RESAMPLE_SIZE; i < RESAMPLE_SIZE; i++) {
-		ssize_t oi = i + off;
-		if (oi < 0 || oi >= len) {
-			continue;
-		}
-		real_t sin_x = i % 2 ? -sin_dsf : sin_dsf;
-		acc += data[oi] * (sin_x / ((real_t)i + dsf));
+/** @brief Works out the delay and gain of a source at a mic
+ *  @param t Trajectory from `gen_trajectory`
+ *  @param n Number of positions
+ *  @param mic_pos Simulated microphone position
+ *  @param rate Sample rate, in Hz
+ *  @param ds Output; delay in samples at each position
+ *  @param amp Output; gain at each position
+ *
+ *  Delays are relative to the origin, so a mic there hears the input as is.
+ *  This is the same arithmetic as `vec3_dist`, spelled out so it vectorizes.
+ */
+static void gen_delays(const struct track *t, size_t n, vec3_t mic_pos, real_t rate,
+                       real_t *ds, real_t *amp)
+{
+	for (size_t i = 0; i < n; i++) {
+		real_t dx = t->x[i] - mic_pos.x, dy = t->y[i] - mic_pos.y, dz = t->z[i] - mic_pos.z;
+		real_t d1 = sqrt(dx * dx + dy * dy + dz * dz);
+		real_t dl = t->d0[i] - d1;
+
+		/* adjust amplitude: inverse linear, not inverse square */
+		amp[i] = BASELINE_DIST / (dl + BASELINE_DIST);
+		ds[i] = dl / SND_SPEED * rate;
 	}
-	return acc;
 }
 
-/** @brief Generates a varying-delay audio stream for a given microphone
+/** @brief Mixes a delayed source into a mic's output
+ *  @param r Resampler for the fractional delays
  *  @param data Input audio data
  *  @param len Length of input data
- *  @param rate Sample rate, in Hz
- *  @param liss_idx Index of lissajous path parameters to use
- *  @param mic_pos Simulated microphone position
+ *  @param start First sample to generate
+ *  @param n Number of samples to generate
+ *  @param ds Delays from `gen_delays`
+ *  @param amp Gains from `gen_delays`
+ *  @param window Weight of each sample, or NULL for none
  *  @param res Result; generated samples will be accumulated here
  *
  *  Simulates a sound source moving in a lissajous trajectory (see liss.c) and
- *  emitting the given audio data being recorded by a microphone at the given
- *  position.
+ *  emitting the given audio data being recorded by a microphone.
  */
-static void gen_delay(real_t *data, size_t len, real_t rate, int liss_idx,
-                      vec3_t mic_pos, real_t *res)
+static void gen_mix(const resampler_t *r, real_t *data, size_t len, size_t start, size_t n,
+                    const real_t *ds, const real_t *amp, const real_t *window, real_t *res)
 {
-	real_t irate = 1.0 / rate;
+	if (window == NULL) {
+		for (size_t i = 0; i < n; i++) {
+			res[i] += amp[i] * resample(r, data, len, start + i, ds[i]);
+		}
+		return;
+	}
 
-	for (size_t i = 0; i < len; i++) {
-		vec3_t source_pos = liss_pos((real_t)i * irate, liss_idx);
-		real_t d0 = vec3_dist(source_pos, vec3_zero);
-		real_t d1 = vec3_dist(source_pos, mic_pos);
-		real_t dl = d0 - d1;
+	for (size_t i = 0; i < n; i++) {
+		res[i] += window[i] * amp[i] * resample(r, data, len, start + i, ds[i]);
+	}
+}
+
+/** @brief Works out the largest delay of any mic relative to the origin
+ *  @param rate Sample rate, in Hz
+ *  @return Delay, in samples
+ */
+static real_t max_mic_delay(real_t rate)
+{
+	double max_mic = 0.0;
+
+	for (int mic = 0; mic < array.n_mics; mic++) {
+		double d = vec3_dist(array.pos[mic], vec3_zero);
+		max_mic = d > max_mic ? d : max_mic;
+	}
+
+	return max_mic / SND_SPEED * rate;
+}
+
+/** @brief Sets up the FFT delay engine
+ *  @param block Hop between blocks, a power of two
+ *  @param rate Sample rate, in Hz
+ *  @return 0 on success, negative on failure
+ *
+ *  Every block of 2 * `block` output samples is the input, windowed and
+ *  transformed once, with a linear phase ramp for the delay of each mic at
+ *  the block's centre. The blocks overlap by half and their Hann windows sum
+ *  to one, so the delay is crossfaded from block to block.
+ *
+ *  Each block's input is the 4 * `block` samples around it, tapered at both
+ *  ends. No mic is further from the origin than the largest delay, so the
+ *  input is shared by all mics; the taper has to fit outside the samples
+ *  any of them can need.
+ */
+static int fft_setup(int block, real_t rate)
+{
+	int len = 4 * block, taper_len = block - (int)ceil(max_mic_delay(rate)) - 2;
+	real_t *in;
+	fftw_complex *out;
+
+	if (taper_len < TAPER_MIN) {
+		fprintf(stderr, "blocks of %d are too short for the mic array\n", block);
+		return -1;
+	}
 
-		/* sample and adjust amplitude: inverse linear, not inverse square */
-		real_t amp = BASELINE_DIST / (dl + BASELINE_DIST);
-		res[i] += amp * resample(data, len, i, dl / SND_SPEED * rate);
+	param.taper = malloc(len * sizeof(param.taper[0]));
+	param.window = malloc(2 * block * sizeof(param.window[0]));
+	in = fftw_alloc_real(len);
+	out = fftw_alloc_complex(len / 2 + 1);
+	if (param.taper == NULL || param.window == NULL || in == NULL || out == NULL) {
+		fprintf(stderr, "can't allocate FFT buffers\n");
+		return -1;
+	}
+
+	for (int i = 0; i < len; i++) {
+		int j = i < len / 2 ? i : len - 1 - i;
+		double w = j < taper_len ? sin(M_PI / 2 * (j + 0.5) / taper_len) : 1.0;
+		param.taper[i] = w * w;
+	}
+	for (int i = 0; i < 2 * block; i++) {
+		double w = sin(M_PI * i / (2 * block));
+		param.window[i] = w * w;
+	}
+
+	param.fwd = fftw_plan_dft_r2c_1d(len, in, out, FFTW_MEASURE);
+	param.inv = fftw_plan_dft_c2r_1d(len, out, in, FFTW_MEASURE);
+	if (param.fwd == NULL || param.inv == NULL) {
+		fprintf(stderr, "can't plan %d-point FFTs\n", len);
+		return -1;
+	}
+
+	param.block = block;
+	return 0;
+}
+
+/** @brief Mixes a delayed source into every mic's output, a block at a time
+ *  @param t Scratch space; output is accumulated in `acc`
+ *  @param src Source number
+ *  @param start First sample of tile, a multiple of the block
+ *  @param n Number of samples in tile
+ *
+ *  Blocks over which a mic's delay changes by more than `param.max_step`
+ *  would smear too much when crossfaded, so those are done by `gen_mix`.
+ */
+static void gen_mix_fft(struct tile_buf *t, int src, size_t start, size_t n)
+{
+	struct fft_buf *fb = t->fft;
+	real_t rate = (real_t)(param.sample_rate);
+	real_t *data = param.streams[src];
+	ptrdiff_t block = param.block, len = 4 * block, n_data = param.n_samples;
+	ptrdiff_t first = start / block, last = (start + n + block - 1) / block;
+	size_t n_ctl = last - first + 3;
+
+	/* delays at the centres of every block touching the tile, plus one
+	 * either side to tell how fast they change
+	 */
+	gen_trajectory(src, rate, (first - 1) * block, block, n_ctl, &fb->ctl);
+	for (int mic = 0; mic < array.n_mics; mic++) {
+		gen_delays(&fb->ctl, n_ctl, array.pos[mic], rate, fb->ds[mic], fb->amp[mic]);
+	}
+
+	for (ptrdiff_t b = first; b <= last; b++) {
+		size_t c = b - first + 1;
+		ptrdiff_t centre = b * block;
+		ptrdiff_t lo = centre - block < (ptrdiff_t)start ? (ptrdiff_t)start : centre - block;
+		ptrdiff_t hi = centre + block > (ptrdiff_t)(start + n) ? (ptrdiff_t)(start + n) : centre + block;
+		int have_spec = 0, have_path = 0, fallbacks = 0;
+
+		for (int mic = 0; mic < array.n_mics; mic++) {
+			real_t *ds = fb->ds[mic], *res = t->acc[mic] + (lo - start);
+			const real_t *window = param.window + (lo - (centre - block));
+
+			if (fabs(ds[c] - ds[c - 1]) > param.max_step ||
+			    fabs(ds[c + 1] - ds[c]) > param.max_step) {
+				if (!have_path) {
+					gen_trajectory(src, rate, lo, 1, hi - lo, &t->path);
+					have_path = 1;
+				}
+				gen_delays(&t->path, hi - lo, array.pos[mic], rate, t->ds, t->amp);
+				gen_mix(&param.resampler, data, n_data, lo, hi - lo, t->ds, t->amp, window, res);
+				fallbacks++;
+				continue;
+			}
+
+			if (!have_spec) {
+				ptrdiff_t at = centre - 2 * block;
+				for (ptrdiff_t i = 0; i < len; i++) {
+					fb->in[i] = at + i >= 0 && at + i < n_data ? data[at + i] * param.taper[i] : 0.0;
+				}
+				fftw_execute_dft_r2c(param.fwd, fb->in, fb->spec);
+				have_spec = 1;
+			}
+
+			/* delaying by ds is multiplying bin k by e^(2 pi i k ds / len); the
+			 * Nyquist bin has to stay real, which leaves its cosine
+			 */
+			double complex rot = cexp(2.0 * M_PI * I * ds[c] / len);
+			double complex ph = fb->amp[mic][c] / len;
+			for (ptrdiff_t k = 0; k < len / 2; k++) {
+				fb->shift[k] = fb->spec[k] * ph;
+				ph *= rot;
+			}
+			fb->shift[len / 2] = fb->spec[len / 2] * creal(ph);
+			fftw_execute_dft_c2r(param.inv, fb->shift, fb->out);
+
+			for (ptrdiff_t i = 0; i < hi - lo; i++) {
+				res[i] += window[i] * fb->out[lo - (centre - 2 * block) + i];
+			}
+		}
+
+		/* blocks straddling two tiles are counted by the one with their centre */
+		if (centre < (ptrdiff_t)(start + n)) {
+			atomic_fetch_add(&param.fallbacks, fallbacks);
+			atomic_fetch_add(&param.blocks, array.n_mics);
+		}
+	}
+}
+
+/* one input file being loaded by `load_files` */
+struct load_file {
+	const char *name;
+	wav_map_t wav;
+	real_t *stream;
+	int n_chunks;
+	atomic_int done; /* chunks converted so far */
+};
+
+/* all of the inputs - jobs are chunks of files, in file order */
+struct load_job {
+	struct load_file *files;
+	int n_files;
+};
+
+/** @brief Converts one chunk of an input file
+ *  @param arg `struct load_job`
+ *  @param job Chunk number, counting through all files
+ *  @param worker Unused
+ *
+ *  Reading the mapped file is what pages it in, so the reads of all chunks
+ *  of all files overlap.
+ */
+static void load_chunk(void *arg, int job, int worker)
+{
+	struct load_job *load = arg;
+	struct load_file *f = load->files;
+	int done;
+
+	while (job >= f->n_chunks) {
+		job -= f->n_chunks;
+		f++;
+	}
+
+	size_t start = (size_t)job * LOAD_CHUNK;
+	size_t n = f->wav.len - start < LOAD_CHUNK ? f->wav.len - start : LOAD_CHUNK;
+	wav_map_read(&f->wav, start, n, f->stream + start);
+
+	/* report progress in tenths */
+	done = atomic_fetch_add(&f->done, 1) + 1;
+	if (done == f->n_chunks) {
+		printf("%s: rate %d, %lu samples\n", f->name, f->wav.rate, f->wav.len);
+	} else if (done * 10 / f->n_chunks != (done - 1) * 10 / f->n_chunks) {
+		printf("%s: %d%%\n", f->name, done * 100 / f->n_chunks);
 	}
 }
 
 /** @brief Loads files into separate audio streams and extends them to be of equal length
+ *  @param pool Workers to load with
  *  @param n_files Number of files to load
  *  @param fnames Filenames to load
  *  @param n_samples_out Output; number of samples will be stored here
  *  @param sample_rate_out Output; sample rate will be stored here
+ *
+ *  The headers of all files are checked first, then all files are read and
+ *  converted at once, in chunks spread over the workers.
  */
-static real_t **load_files(int n_files, char **fnames, size_t *n_samples_out, int32_t *sample_rate_out)
+static real_t **load_files(pool_t *pool, int n_files, char **fnames, size_t *n_samples_out,
+                           int32_t *sample_rate_out)
 {
 	size_t max_len = 0;
-	int32_t wav_rate, sample_rate = 0;
+	int32_t sample_rate = 0;
+	int n_chunks = 0;
 
 	real_t **streams = calloc(n_files, sizeof(streams[0]));
-	size_t *stream_len = calloc(n_files, sizeof(stream_len[0]));
-	if (streams == NULL || stream_len == NULL) {
+	struct load_file *files = calloc(n_files, sizeof(files[0]));
+	if (streams == NULL || files == NULL) {
 		goto fail_alloc;
 	}
 
-	/* load all files and track max stream length */
+	/* map all files and track max stream length */
 	for (int i = 0; i < n_files; i++) {
-		streams[i] = wav_read_mono_16(fnames[i], &wav_rate, &stream_len[i]);
-		if (streams[i] == NULL) {
+		files[i].name = fnames[i];
+		if (wav_map(fnames[i], &files[i].wav) < 0) {
 			goto fail_load;
 		}
 
 		/* sample rates must be the same for all input files */
-		printf("%s: rate %d, %lu samples\n", fnames[i], wav_rate, stream_len[i]);
+		int32_t wav_rate = files[i].wav.rate;
 		if (sample_rate && sample_rate != wav_rate) {
 			fprintf(stderr, "sample rate mismatch: current %d <> previous %d\n", wav_rate, sample_rate);
 			goto fail_load;
 		}
 
 		sample_rate = wav_rate;
-		max_len = stream_len[i] > max_len ? stream_len[i] : max_len;
+		max_len = files[i].wav.len > max_len ? files[i].wav.len : max_len;
 	}
 
-	/* extend shorter streams to maximum length */
+	/* every stream gets room for the longest one, so no reallocs later */
 	for (int i = 0; i < n_files; i++) {
-		size_t len = stream_len[i];
-		if (len < max_len) {
-			streams[i] = realloc(streams[i], max_len * sizeof(streams[i][0]));
-			if (streams[i] == NULL) {
-				fprintf(stderr, "extending stream %d failed\n", i);
-				goto fail_load;
-			}
+		streams[i] = files[i].stream = malloc((max_len ? max_len : 1) * sizeof(streams[i][0]));
+		if (streams[i] == NULL) {
+			fprintf(stderr, "%s: cannot allocate memory for %lu samples\n", fnames[i], max_len);
+			goto fail_load;
+		}
+		files[i].n_chunks = (files[i].wav.len + LOAD_CHUNK - 1) / LOAD_CHUNK;
+		atomic_init(&files[i].done, 0);
+		n_chunks += files[i].n_chunks;
+	}
 
-			for (size_t pos = len; pos < max_len; pos += len) {
-				size_t to_copy = len > (max_len - pos) ? max_len - pos : len;
-				memcpy(streams[i] + pos, streams[i], to_copy * sizeof(streams[i][0]));
-			}
+	struct load_job job = { files, n_files };
+	pool_run(pool, n_chunks, load_chunk, &job);
+
+	/* extend shorter streams to maximum length */
+	for (int i = 0; i < n_files; i++) {
+		size_t len = files[i].wav.len;
+		if (len == 0) {
+			memset(streams[i], 0, max_len * sizeof(streams[i][0]));
+			continue;
+		}
+		for (size_t pos = len; pos < max_len; pos += len) {
+			size_t to_copy = len > (max_len - pos) ? max_len - pos : len;
+			memcpy(streams[i] + pos, streams[i], to_copy * sizeof(streams[i][0]));
 		}
 	}
 
+	for (int i = 0; i < n_files; i++) {
+		wav_unmap(&files[i].wav);
+	}
 	*n_samples_out = max_len;
 	*sample_rate_out = sample_rate;
-	free(stream_len);
+	free(files);
 	return streams;
 
 fail_load:
 	for (int i = 0; i < n_files; i++) {
+		wav_unmap(&files[i].wav);
 		free(streams[i]);
 	}
 fail_alloc:
 	free(streams);
-	free(stream_len);
+	free(files);
 	return NULL;
 }
 
-/** @brief Writes a sound stream to a file
- *  @param file_prefix Filename prefix; output filenames will be f_prefix.number.wav
- *  @param num Number of file
- *  @param rate Sample rate, in Hz
- *  @param data Audio samples to write
- *  @param len Length of data
+/** @brief Generates one tile of output
+ *  @param arg Unused
+ *  @param tile Tile number, within `param.chunk`
+ *  @param worker Worker number, for picking scratch space
+ *
+ *  Either mixes the cached renders of every source, or renders sources
+ *  `param.src_lo` to `param.src_hi` - as floats if `param.caching` is set,
+ *  for the cache, or else straight to the output.
+ *
+ *  Every sample only depends on its own position and the inputs, and the
+ *  sources are always summed in the same order, so the output doesn't depend
+ *  on the tiling or on which worker runs what. With the sinc engine and no
+ *  room a source's render is exactly what it would add to the sum, so mixing
+ *  cached renders gives the same output. The FFT engine and reflections add
+ *  several partial sums per source, which a cached render has already added
+ *  together, so there mixing can be 1 LSB off.
  */
-static void write_file(char *file_prefix, size_t num, int32_t rate, int16_t *data, size_t len)
-{
-	char buf[256];
-	snprintf(buf, 256, "%s.%lu.wav", file_prefix, num);
-	wav_write_mono_16(buf, rate, data, len);
-	printf("%s written\n", buf);
-}
-
-void *gen_thread(void *id_v)
+static void gen_tile(void *arg, int tile, int worker)
 {
-	size_t n_samples = param.n_samples;
-	int index, thr_id = (intptr_t)id_v;
+	struct chunk *c = param.chunk;
+	size_t at = (size_t)tile * TILE_LEN, start = c->start + at;
+	size_t n = c->n - at < TILE_LEN ? c->n - at : TILE_LEN;
+	struct tile_buf *t = &param.tiles[worker];
 	real_t istreams = 1.0 / (real_t)param.n_streams;
+	int mix = param.cached != NULL && param.caching == NULL;
+	int done;
 
-	while ((index = atomic_fetch_add(&param.index, 1)) < N_MICS) {
-		int16_t *out_samples = param.out_samples + n_samples * thr_id;
-		real_t *out_acc = param.out_acc + n_samples * thr_id;
+	/* accumulate output streams */
+	memset(t->acc, 0, array.n_mics * sizeof(t->acc[0]));
+	for (int i = 0; i < param.n_streams && mix; i++) {
+		for (int mic = 0; mic < array.n_mics; mic++) {
+			const real_t *cached = param.cached[i][mic].data + start;
+			for (size_t j = 0; j < n; j++) {
+				t->acc[mic][j] += cached[j];
+			}
+		}
+	}
+	for (int i = param.src_lo; i < param.src_hi && !mix; i++) {
+		if (param.engine == ENGINE_FFT) {
+			gen_mix_fft(t, i, start, n);
+			continue;
+		}
 
-		/* accumulate output streams */
-		printf("starting mic: %d\n", index);
-		memset(out_acc, 0, n_samples * sizeof(out_acc[0]));
-		for (int i = 0; i < param.n_streams; i++) {
-			gen_delay(param.streams[i], n_samples, (real_t)(param.sample_rate),
-			          i, mic_pos[index], out_acc);
+		gen_trajectory(i, (real_t)(param.sample_rate), start, 1, n, &t->path);
+		for (int mic = 0; mic < array.n_mics; mic++) {
+			gen_delays(&t->path, n, array.pos[mic], (real_t)(param.sample_rate), t->ds, t->amp);
+			gen_mix(&param.resampler, param.streams[i], param.n_samples, start, n,
+			        t->ds, t->amp, NULL, t->acc[mic]);
+		}
+	}
+
+	if (param.room != NULL && !mix) {
+		for (int mic = 0; mic < array.n_mics; mic++) {
+			const real_t *reverb = param.reverb + CHUNK_LEN * mic + at;
+			for (size_t i = 0; i < n; i++) {
+				t->acc[mic][i] += reverb[i];
+			}
 		}
+	}
 
-		/* scale to 16-bit int, round, and clamp sample */
-		for (size_t i = 0; i < n_samples; i++) {
-			int32_t isample = (int32_t)round(out_acc[i] * istreams * ((int32_t)INT16_MAX + 1));
+	/* scale to 16-bit int, round, and clamp sample */
+	for (int mic = 0; mic < array.n_mics && param.caching != NULL; mic++) {
+		memcpy(c->render + CHUNK_LEN * mic + at, t->acc[mic], n * sizeof(t->acc[mic][0]));
+	}
+	for (int mic = 0; mic < array.n_mics && param.caching == NULL; mic++) {
+		int16_t *out_samples = c->out + CHUNK_LEN * mic + at;
+		for (size_t i = 0; i < n; i++) {
+			int32_t isample = (int32_t)round(t->acc[mic][i] * istreams * ((int32_t)INT16_MAX + 1));
 			out_samples[i] = isample > INT16_MAX ? INT16_MAX : 
 			                 isample < INT16_MIN ? INT16_MIN :
 			                 (int16_t)isample;
 		}
+	}
+
+	/* report progress in tenths */
+	done = atomic_fetch_add(&param.tiles_done, 1) + 1;
+	if (done * 10 / param.n_tiles != (done - 1) * 10 / param.n_tiles) {
+		printf("generated %d%%\n", done * 100 / param.n_tiles);
+	}
+}
+
+/** @brief Works out the room reflections heard by one mic over a chunk
+ *  @param arg Unused
+ *  @param mic Mic number
+ *  @param worker Worker number, for picking scratch space
+ *
+ *  Each source is convolved with its impulse response to the mic, which is
+ *  recomputed for where the source is every `param.rir_update` samples and
+ *  crossfaded in over one partition. The input is read `param.rir_pre`
+ *  samples ahead to make up for that much delay in the impulse responses.
+ *  Chunks are a whole number of partitions, so the convolution just carries
+ *  on from one chunk to the next.
+ */
+static void reverb_job(void *arg, int mic, int worker)
+{
+	struct reverb_buf *rb = &param.reverbs[worker];
+	struct chunk *c = param.chunk;
+	real_t rate = (real_t)(param.sample_rate), irate = 1.0 / rate;
+	real_t *res = param.reverb + CHUNK_LEN * mic;
+	size_t n_samples = param.n_samples, pre = param.rir_pre;
+
+	memset(res, 0, c->n * sizeof(res[0]));
+	for (int i = param.src_lo; i < param.src_hi; i++) {
+		struct reverb_state *rs = &param.reverb_states[i * array.n_mics + mic];
+		real_t *data = param.streams[i];
+
+		if (c->start == 0) {
+			conv_reset(&rs->conv);
+			rs->next_update = 0;
+		}
+		for (size_t at = c->start; at < c->start + c->n; at += RIR_PART) {
+			size_t n = n_samples - at < RIR_PART ? n_samples - at : RIR_PART;
+
+			if (at >= rs->next_update) {
+				vec3_t pos = liss_pos((real_t)(at + param.rir_update / 2) * irate, param.paths, i);
+				room_rir(param.room, pos, array.pos[mic], rate, &param.resampler, pre,
+				         rb->rir, param.rir_len);
+				conv_set_filter(&rs->conv, rb->rir);
+				rs->next_update += param.rir_update;
+			}
+
+			for (size_t j = 0; j < RIR_PART; j++) {
+				rb->in[j] = at + pre + j < n_samples ? data[at + pre + j] : 0.0;
+			}
+			memset(rb->out, 0, sizeof(rb->out));
+			conv_block(&rs->conv, rb->in, rb->out);
+			for (size_t j = 0; j < n; j++) {
+				res[at - c->start + j] += rb->out[j];
+			}
+		}
+	}
+}
+
+/** @brief Sets up the room reflections
+ *  @param n_threads Number of workers
+ *  @param rir_ms Length of impulse responses, in ms
+ *  @param update_ms Time between impulse responses, in ms
+ *  @return 0 on success, negative on failure
+ */
+static int reverb_setup(int n_threads, real_t rir_ms, real_t update_ms)
+{
+	real_t rate = (real_t)(param.sample_rate);
+	size_t n_parts = (size_t)ceil(rir_ms / 1000.0 * rate / RIR_PART);
+	vec3_t half = vec3_scale(param.room->size, 0.5);
+
+	if (n_parts < 1 || update_ms <= 0.0) {
+		fprintf(stderr, "impulse response length and update time must be positive\n");
+		return -1;
+	}
+	param.rir_len = n_parts * RIR_PART;
+	param.rir_update = (size_t)ceil(update_ms / 1000.0 * rate);
+	param.rir_pre = ceil(max_mic_delay(rate)) + param.resampler.taps;
 
-		write_file(param.file_prefix, index, param.sample_rate, out_samples, n_samples);
-		printf("finished: %d\n", index);
+	/* images are only right for sources inside the room */
+	for (int i = 0; i < param.n_streams; i++) {
+		for (size_t at = 0; at < param.n_samples; at += param.rir_update) {
+			vec3_t pos = liss_pos((real_t)at / rate, param.paths, i);
+			if (fabs(pos.x) >= half.x || fabs(pos.y) >= half.y || fabs(pos.z) >= half.z) {
+				fprintf(stderr, "warning: source %d leaves the room\n", i);
+				break;
+			}
+		}
+	}
+
+	if (conv_plan_init(&param.conv_plan, RIR_PART) < 0) {
+		fprintf(stderr, "can't plan %d-point FFTs\n", 2 * RIR_PART);
+		return -1;
+	}
+
+	param.reverb = malloc(CHUNK_LEN * array.n_mics * sizeof(param.reverb[0]));
+	param.reverbs = calloc(n_threads, sizeof(param.reverbs[0]));
+	param.reverb_states = calloc(param.n_streams * array.n_mics, sizeof(param.reverb_states[0]));
+	if (param.reverb == NULL || param.reverbs == NULL || param.reverb_states == NULL) {
+		fprintf(stderr, "can't allocate space for reflections\n");
+		return -1;
+	}
+	for (int i = 0; i < n_threads; i++) {
+		struct reverb_buf *rb = &param.reverbs[i];
+		rb->rir = malloc(param.rir_len * sizeof(rb->rir[0]));
+		if (rb->rir == NULL) {
+			fprintf(stderr, "can't allocate space for reflections\n");
+			return -1;
+		}
+	}
+	for (int i = 0; i < param.n_streams * array.n_mics; i++) {
+		if (conv_init(&param.reverb_states[i].conv, &param.conv_plan, n_parts) < 0) {
+			fprintf(stderr, "can't allocate space for reflections\n");
+			return -1;
+		}
 	}
 
+	return 0;
+}
+
+/** @brief Writes out finished chunks, in the background
+ *  @param arg Unused
+ *  @return NULL
+ *
+ *  Takes each chunk handed over by `render` and appends it to the output
+ *  files, or to the cache. `param.io_chunk` is cleared once it's written,
+ *  which is what lets the workers reuse it.
+ */
+static void *io_thread(void *arg)
+{
+	pthread_mutex_lock(&param.io_lock);
+	for (;;) {
+		while (param.io_chunk == NULL && !param.io_quit) {
+			pthread_cond_wait(&param.io_cond, &param.io_lock);
+		}
+		if (param.io_chunk == NULL) {
+			break;
+		}
+		struct chunk *c = param.io_chunk;
+		pthread_mutex_unlock(&param.io_lock);
+
+		for (int mic = 0; mic < array.n_mics; mic++) {
+			if (param.caching != NULL) {
+				cache_writer_append(&param.caching[mic], c->render + CHUNK_LEN * mic, c->n);
+			} else {
+				wav_writer_append(&param.out[mic], c->out + CHUNK_LEN * mic, c->n);
+			}
+		}
+
+		pthread_mutex_lock(&param.io_lock);
+		param.io_chunk = NULL;
+		pthread_cond_broadcast(&param.io_cond);
+	}
+	pthread_mutex_unlock(&param.io_lock);
+
 	return NULL;
 }
 
+/** @brief Hands a chunk to the I/O thread, once it's done with the last one
+ *  @param c Chunk to write, or NULL to wait for the last one and stop
+ */
+static void io_submit(struct chunk *c)
+{
+	pthread_mutex_lock(&param.io_lock);
+	while (param.io_chunk != NULL) {
+		pthread_cond_wait(&param.io_cond, &param.io_lock);
+	}
+	param.io_chunk = c;
+	param.io_quit = c == NULL;
+	pthread_cond_broadcast(&param.io_cond);
+	pthread_mutex_unlock(&param.io_lock);
+}
+
+/** @brief Renders the direct path and reflections of sources, or mixes their
+ *         cached renders, and writes them out
+ *  @param pool Thread pool
+ *  @param lo First source
+ *  @param hi One past last source
+ *  @return 0 on success, negative on failure
+ *
+ *  Output goes to `param.caching` if that's set, or else `param.out`. Each
+ *  chunk is written by a background thread while the workers generate the
+ *  next one, in the other buffer.
+ */
+static int render(pool_t *pool, int lo, int hi)
+{
+	pthread_t io;
+	int mix = param.cached != NULL && param.caching == NULL;
+
+	param.src_lo = lo;
+	param.src_hi = hi;
+	param.io_quit = 0;
+	atomic_store(&param.tiles_done, 0);
+
+	if (pthread_create(&io, NULL, io_thread, NULL) != 0) {
+		fprintf(stderr, "can't create I/O thread\n");
+		return -1;
+	}
+
+	for (size_t start = 0, k = 0; start < param.n_samples; start += CHUNK_LEN, k++) {
+		struct chunk *c = &param.chunks[k % 2];
+
+		/* `io_submit` waited for the last chunk in this buffer to be written
+		 * before taking the one after it
+		 */
+		c->start = start;
+		c->n = param.n_samples - start < CHUNK_LEN ? param.n_samples - start : CHUNK_LEN;
+		param.chunk = c;
+
+		if (param.room != NULL && !mix) {
+			pool_run(pool, array.n_mics, reverb_job, NULL);
+		}
+		pool_run(pool, (c->n + TILE_LEN - 1) / TILE_LEN, gen_tile, NULL);
+		io_submit(c);
+	}
+
+	io_submit(NULL);
+	pthread_join(io, NULL);
+	return 0;
+}
+
+/** @brief Works out the cache key of a source's render at each mic
+ *  @param src Source number
+ *  @param half Interpolation filter taps on each side
+ *  @param phases Interpolation filter phases
+ *  @param keys Output; key for each mic
+ *
+ *  Covers everything the render depends on: the input, its trajectory, the
+ *  rate and length, the delay engine and room settings, the mic position, and
+ *  the furthest mic's delay, which sets the FFT engine's taper and the
+ *  reflections' lead-in.
+ */
+static void cache_keys(int src, int half, int phases, uint64_t keys[ARRAY_MICS_MAX])
+{
+	uint64_t key = CACHE_KEY_INIT;
+	int version = CACHE_VERSION, sample_size = sizeof(real_t);
+	double baseline = BASELINE_DIST;
+	real_t max_delay = max_mic_delay((real_t)param.sample_rate);
+	size_t size;
+	const void *liss = liss_params(param.paths, src, &size);
+
+	key = cache_hash(key, &version, sizeof(version));
+	key = cache_hash(key, &sample_size, sizeof(sample_size));
+	key = cache_hash(key, &baseline, sizeof(baseline));
+	key = cache_hash(key, &param.sample_rate, sizeof(param.sample_rate));
+	key = cache_hash(key, &param.n_samples, sizeof(param.n_samples));
+	key = cache_hash(key, param.streams[src], param.n_samples * sizeof(param.streams[src][0]));
+	key = cache_hash(key, liss, size);
+	key = cache_hash(key, &half, sizeof(half));
+	key = cache_hash(key, &phases, sizeof(phases));
+	key = cache_hash(key, &param.engine, sizeof(param.engine));
+	key = cache_hash(key, &max_delay, sizeof(max_delay));
+	if (param.engine == ENGINE_FFT) {
+		key = cache_hash(key, &param.block, sizeof(param.block));
+		key = cache_hash(key, &param.max_step, sizeof(param.max_step));
+	}
+	if (param.room != NULL) {
+		int part = RIR_PART;
+		key = cache_hash(key, param.room, sizeof(*param.room));
+		key = cache_hash(key, &param.rir_len, sizeof(param.rir_len));
+		key = cache_hash(key, &param.rir_update, sizeof(param.rir_update));
+		key = cache_hash(key, &part, sizeof(part));
+	}
+
+	/* -0.0 and 0.0 are the same position */
+	for (int mic = 0; mic < array.n_mics; mic++) {
+		vec3_t pos = array.pos[mic];
+		pos.x = pos.x == 0.0 ? 0.0 : pos.x;
+		pos.y = pos.y == 0.0 ? 0.0 : pos.y;
+		pos.z = pos.z == 0.0 ? 0.0 : pos.z;
+		keys[mic] = cache_hash(key, &pos, sizeof(pos));
+	}
+}
+
+/** @brief Gets every source's render from the cache, rendering any missing
+ *  @param pool Thread pool
+ *  @param half Interpolation filter taps on each side
+ *  @param phases Interpolation filter phases
+ *  @return 0 on success, negative on failure
+ */
+static int cache_sources(pool_t *pool, int half, int phases)
+{
+	char dir[256];
+	cache_writer_t writers[ARRAY_MICS_MAX];
+	int failed;
+
+	if (cache_dir(dir, sizeof(dir)) < 0) {
+		fprintf(stderr, "nowhere to put the render cache\n");
+		return -1;
+	}
+
+	param.cached = calloc(param.n_streams, sizeof(param.cached[0]));
+	if (param.cached == NULL) {
+		fprintf(stderr, "can't allocate space for cached renders\n");
+		return -1;
+	}
+
+	for (int i = 0; i < param.n_streams; i++) {
+		uint64_t keys[ARRAY_MICS_MAX];
+		int missing = 0;
+
+		cache_keys(i, half, phases, keys);
+		for (int mic = 0; mic < array.n_mics; mic++) {
+			missing |= cache_load(dir, keys[mic], param.n_samples, &param.cached[i][mic]) < 0;
+		}
+		if (!missing) {
+			printf("source %d: cached\n", i);
+			continue;
+		}
+
+		for (int j = 0; j < 2; j++) {
+			if (param.chunks[j].render == NULL) {
+				param.chunks[j].render = malloc(CHUNK_LEN * array.n_mics * sizeof(param.chunks[j].render[0]));
+			}
+			if (param.chunks[j].render == NULL) {
+				fprintf(stderr, "can't allocate space for rendering\n");
+				return -1;
+			}
+		}
+		printf("source %d: rendering\n", i);
+
+		for (int mic = 0; mic < array.n_mics; mic++) {
+			cache_unmap(&param.cached[i][mic]);
+			if (cache_writer_open(&writers[mic], dir, keys[mic]) < 0) {
+				while (mic-- > 0) {
+					writers[mic].failed = 1;
+					cache_writer_close(&writers[mic]);
+				}
+				fprintf(stderr, "can't cache render of source %d\n", i);
+				return -1;
+			}
+		}
+
+		param.caching = writers;
+		failed = render(pool, i, i + 1) < 0;
+		param.caching = NULL;
+
+		for (int mic = 0; mic < array.n_mics; mic++) {
+			writers[mic].failed |= failed;
+			failed |= cache_writer_close(&writers[mic]) < 0;
+		}
+		for (int mic = 0; mic < array.n_mics && !failed; mic++) {
+			failed = cache_load(dir, keys[mic], param.n_samples, &param.cached[i][mic]) < 0;
+		}
+		if (failed) {
+			fprintf(stderr, "can't cache render of source %d\n", i);
+			return -1;
+		}
+	}
+
+	/* from here on, `gen_tile` mixes the cached renders */
+	for (int j = 0; j < 2; j++) {
+		free(param.chunks[j].render);
+		param.chunks[j].render = NULL;
+	}
+	return 0;
+}
+
+/** @brief Creates the output files
+ *  @param file_prefix Filename prefix; output filenames will be file_prefix.number.wav
+ *  @return 0 on success, negative on failure
+ */
+static int open_outputs(const char *file_prefix)
+{
+	char buf[256];
+
+	for (int mic = 0; mic < array.n_mics; mic++) {
+		snprintf(buf, sizeof(buf), "%s.%d.wav", file_prefix, mic);
+		if (wav_writer_open(&param.out[mic], buf, param.sample_rate, 1) < 0) {
+			while (mic-- > 0) {
+				wav_writer_close(&param.out[mic]);
+			}
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** @brief Finishes the output files
+ *  @param file_prefix Filename prefix, as given to `open_outputs`
+ *  @return 0 on success, negative if any of them couldn't be written
+ */
+static int close_outputs(const char *file_prefix)
+{
+	char buf[256];
+	int ret = 0;
+
+	for (int mic = 0; mic < array.n_mics; mic++) {
+		snprintf(buf, sizeof(buf), "%s.%d.wav", file_prefix, mic);
+		if (wav_writer_close(&param.out[mic]) < 0) {
+			ret = -1;
+		} else {
+			printf("%s written\n", buf);
+		}
+	}
+
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
-	pthread_t threads[N_MICS];
 	size_t n_samples;
 	int32_t sample_rate;
-	int n_threads, n_streams = argc - 2;
+	int n_threads, n_streams, opt;
+	int half = RESAMPLE_HALF_DEFAULT, phases = RESAMPLE_PHASES_DEFAULT;
+	int block = BLOCK_DEFAULT;
+	room_t room = { .beta = ROOM_BETA_DEFAULT };
+	double rx, ry, rz;
+	real_t rir_ms = RIR_MS_DEFAULT, update_ms = RIR_UPDATE_MS_DEFAULT;
+
+	int use_cache = 0;
+	const char *array_file = NULL;
+
+	param.engine = ENGINE_SINC;
+	param.max_step = MAX_STEP_DEFAULT;
+	while ((opt = getopt(argc, argv, "a:t:p:e:b:d:r:w:l:u:cv")) != -1) {
+		switch (opt) {
+		case 'a': array_file = optarg; break;
+		case 't': half = atoi(optarg); break;
+		case 'p': phases = atoi(optarg); break;
+		case 'e':
+			if (!strcmp(optarg, "sinc")) {
+				param.engine = ENGINE_SINC;
+			} else if (!strcmp(optarg, "fft")) {
+				param.engine = ENGINE_FFT;
+			} else {
+				fprintf(stderr, "unknown delay engine: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b': block = atoi(optarg); break;
+		case 'd': param.max_step = atof(optarg); break;
+		case 'r':
+			if (sscanf(optarg, "%lf,%lf,%lf", &rx, &ry, &rz) != 3 ||
+			    rx <= 0.0 || ry <= 0.0 || rz <= 0.0) {
+				fprintf(stderr, "room size should be x,y,z in m: %s\n", optarg);
+				return 1;
+			}
+			room.size = (vec3_t){ rx, ry, rz };
+			param.room = &room;
+			break;
+		case 'w': room.beta = atof(optarg); break;
+		case 'l': rir_ms = atof(optarg); break;
+		case 'u': update_ms = atof(optarg); break;
+		case 'c': use_cache = 1; break;
+		case 'v': param.paths = LISS_VOLUME; break;
+		default: optind = argc; break;
+		}
+	}
+	n_streams = argc - optind - 1;
 
-	if (argc < 3) {
-		fprintf(stderr, "usage: %s <outfile_prefix> <infile1> ...\n", argv[0]);
+	if (n_streams < 1) {
+		fprintf(stderr,
+			"usage: %s [options] <outfile_prefix> <infile1> ...\n"
+			"  -a <file>  mic array geometry (default: built-in 12-mic star); channel\n"
+			"             delays in it are ignored\n"
+			"  -t <n>  interpolation filter taps on each side (default: %d)\n"
+			"  -p <n>  interpolation filter phases per sample (default: %d)\n"
+			"  -e <engine>  delay engine: sinc or fft (default: sinc)\n"
+			"  -b <n>  fft engine: block hop, a power of two (default: %d)\n"
+			"  -d <x>  fft engine: largest delay change per block, in samples, before\n"
+			"          falling back to sinc (default: %g)\n"
+			"  -r <x,y,z>  add reflections off the walls of a room this size, in m,\n"
+			"              centred on the array\n"
+			"  -w <x>  wall reflection coefficient (default: %g)\n"
+			"  -l <ms>  length of room impulse responses (default: %d)\n"
+			"  -u <ms>  time between room impulse responses (default: %d)\n"
+			"  -c  keep each source's render at each mic in $GEN_CACHE_DIR (default:\n"
+			"      ~/.cache/gen), and reuse them when nothing that affects them changes\n"
+			"  -v  move sources in 3D rather than in the plane of the array\n",
+			argv[0], RESAMPLE_HALF_DEFAULT, RESAMPLE_PHASES_DEFAULT, BLOCK_DEFAULT,
+			MAX_STEP_DEFAULT, ROOM_BETA_DEFAULT, RIR_MS_DEFAULT, RIR_UPDATE_MS_DEFAULT);
 		return 1;
 	}
 
-#ifdef _SC_NPROCESSORS_ONLN
-	n_threads = sysconf(_SC_NPROCESSORS_ONLN);
-#else
-	n_threads = 2;
-#endif
-	n_threads = n_threads < 1 ? 1 : n_threads > N_MICS ? N_MICS : n_threads;
+	if (array_file == NULL) {
+		array_default(&array);
+	} else if (array_load(array_file, &array) < 0) {
+		return 1;
+	}
+
+	if (resampler_init(&param.resampler, half, phases) < 0) {
+		fprintf(stderr, "can't create %d-tap, %d-phase resampler\n", 2 * half, phases);
+		return 1;
+	}
+
+	pool_t *pool = pool_create(0);
+	if (pool == NULL) {
+		fprintf(stderr, "can't create worker threads\n");
+		return 1;
+	}
+	n_threads = pool_size(pool);
 
-	real_t **streams = load_files(n_streams, argv + 2, &n_samples, &sample_rate);
+	real_t **streams = load_files(pool, n_streams, argv + optind + 1, &n_samples, &sample_rate);
 	if (streams == NULL) {
 		fprintf(stderr, "failed to load input files\n");
 		return 1;
 	}
 
-	param.out_samples = malloc(n_samples * n_threads * sizeof(param.out_samples[0]));
-	param.out_acc = malloc(n_samples * n_threads * sizeof(param.out_acc[0]));
-	if (param.out_samples == NULL || param.out_acc == NULL) {
+	param.chunks[0].out = malloc(CHUNK_LEN * array.n_mics * sizeof(param.chunks[0].out[0]));
+	param.chunks[1].out = malloc(CHUNK_LEN * array.n_mics * sizeof(param.chunks[1].out[0]));
+	param.tiles = calloc(n_threads, sizeof(param.tiles[0]));
+	if (param.chunks[0].out == NULL || param.chunks[1].out == NULL || param.tiles == NULL) {
 		fprintf(stderr, "can't allocate space for output\n");
 		return 1;
 	}
 
+	if (param.engine == ENGINE_FFT) {
+		if (block < BLOCK_MIN || block > TILE_LEN || (block & (block - 1)) != 0) {
+			fprintf(stderr, "block hop must be a power of two from %d to %d\n",
+			        BLOCK_MIN, TILE_LEN);
+			return 1;
+		}
+		if (fft_setup(block, sample_rate) < 0) {
+			return 1;
+		}
+		for (int i = 0; i < n_threads; i++) {
+			struct fft_buf *fb = malloc(sizeof(*fb));
+			if (fb == NULL) {
+				fprintf(stderr, "can't allocate FFT buffers\n");
+				return 1;
+			}
+			fb->in = fftw_alloc_real(4 * block);
+			fb->out = fftw_alloc_real(4 * block);
+			fb->spec = fftw_alloc_complex(2 * block + 1);
+			fb->shift = fftw_alloc_complex(2 * block + 1);
+			if (fb->in == NULL || fb->out == NULL || fb->spec == NULL || fb->shift == NULL) {
+				fprintf(stderr, "can't allocate FFT buffers\n");
+				return 1;
+			}
+			param.tiles[i].fft = fb;
+		}
+	}
+
 	printf("rate %d, %lu samples\n", sample_rate, n_samples);
 	printf("using %d threads\n", n_threads);
 
-	param.index = 0;
 	param.n_streams = n_streams;
 	param.streams = streams;
-	param.file_prefix = argv[1];
 	param.n_samples = n_samples;
 	param.sample_rate = sample_rate;
+	param.n_tiles = (n_samples + TILE_LEN - 1) / TILE_LEN;
+	atomic_init(&param.tiles_done, 0);
+	atomic_init(&param.fallbacks, 0);
+	atomic_init(&param.blocks, 0);
 
-	memset(threads, 0, sizeof(threads));
-	for (int i = 0; i < n_threads; i++) {
-		pthread_create(&threads[i], NULL, gen_thread, (void*)(intptr_t)i);
+	if (param.room != NULL && reverb_setup(n_threads, rir_ms, update_ms) < 0) {
+		return 1;
 	}
-	for (int i = 0; i < n_threads; i++) {
-		pthread_join(threads[i], NULL);
+	if (use_cache && cache_sources(pool, half, phases) < 0) {
+		return 1;
+	}
+	if (open_outputs(argv[optind]) < 0) {
+		return 1;
+	}
+	if (render(pool, 0, n_streams) < 0) {
+		return 1;
+	}
+	if (param.engine == ENGINE_FFT) {
+		printf("%d of %d mic blocks fell back to sinc\n", atomic_load(&param.fallbacks),
+		       atomic_load(&param.blocks));
+	}
+	if (close_outputs(argv[optind]) < 0) {
+		return 1;
 	}
+	pool_destroy(pool);
 
 	return 0;
 }
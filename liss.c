@@ -9,12 +9,12 @@ typedef struct {
 	vec3_t phase;
 	vec3_t scale;
 	vec3_t trans;
-	real_t rt, rp;
+	real_t rt, rp; /* turn about z and tilt about x, in radians */
 } liss_t;
 
 #define PI2 (M_PI/2.0)
 
-liss_t liss_param[] = {
+static liss_t liss_plane[] = {
 	{
 		.duration = 15.0,
 		.period = { 1.0, 1.0, 0.0 },
@@ -33,15 +33,72 @@ liss_t liss_param[] = {
 	},
 };
 
+/* paths that leave the plane, for trying out 3D localization; they stay
+ * between 0.5 m below and 2.5 m above the array's plane
+ */
+static liss_t liss_volume[] = {
+	{
+		/* circle tilted 30 degrees, 1 m up */
+		.duration = 15.0,
+		.period = { 1.0, 1.0, 0.0 },
+		.phase  = { 0.0, PI2, 0.0 },
+		.scale  = { 3.0, 3.0, 0.0 },
+		.trans  = { 0.0, 0.0, 1.0 },
+		.rt = 0.3, .rp = M_PI / 6.0,
+	},
+	{
+		/* rising and falling three times a lap, turned 45 degrees */
+		.duration = 15.0,
+		.period = { 1.0, 2.0, 3.0 },
+		.phase  = { 0.0, PI2, 0.0 },
+		.scale  = { 4.0, 3.0, 1.0 },
+		.trans  = { 0.0, 0.0, 1.5 },
+		.rt = M_PI / 4.0, .rp = 0.0,
+	},
+};
+
+static struct {
+	liss_t *param;
+	int n;
+} liss_sets[] = {
+	[LISS_PLANE] = { liss_plane, sizeof liss_plane / sizeof liss_plane[0] },
+	[LISS_VOLUME] = { liss_volume, sizeof liss_volume / sizeof liss_volume[0] },
+};
+
 /** @brief Generates a point on a (hard-coded) lissajous path
  *  @param t Time to generate for, in seconds
- *  @param i Index of parameter set to use
+ *  @param set Set of paths, LISS_PLANE or LISS_VOLUME
+ *  @param i Index of path in the set
+ *
+ *  The figure is tilted about x by `rp`, then turned about z by `rt`, then
+ *  moved by `trans`.
  */
-vec3_t liss_pos(real_t t, int i)
+vec3_t liss_pos(real_t t, int set, int i)
 {
-	liss_t *l = &liss_param[i % (sizeof liss_param / sizeof liss_param[0])];
+	liss_t *l = &liss_sets[set].param[i % liss_sets[set].n];
 	real_t nt = t * M_PI * 2.0 / l->duration;
-	/* no rotation yet */
 	vec3_t bv = vec3_sin(vec3_add(vec3_scale(l->period, nt), l->phase));
-	return vec3_add(vec3_mul(bv, l->scale), l->trans);
+	vec3_t p = vec3_mul(bv, l->scale);
+
+	if (l->rp != 0.0) {
+		real_t c = cos(l->rp), s = sin(l->rp);
+		p = (vec3_t){ p.x, p.y * c - p.z * s, p.y * s + p.z * c };
+	}
+	if (l->rt != 0.0) {
+		real_t c = cos(l->rt), s = sin(l->rt);
+		p = (vec3_t){ p.x * c - p.y * s, p.x * s + p.y * c, p.z };
+	}
+	return vec3_add(p, l->trans);
+}
+
+/** @brief Gets the parameters of a lissajous path, e.g. to tell paths apart
+ *  @param set Set of paths, LISS_PLANE or LISS_VOLUME
+ *  @param i Index of path in the set
+ *  @param size Output; size of parameters, in bytes
+ *  @return Parameters
+ */
+const void *liss_params(int set, int i, size_t *size)
+{
+	*size = sizeof(liss_t);
+	return &liss_sets[set].param[i % liss_sets[set].n];
 }
@@ -1,9 +1,16 @@
 #ifndef _LISS_T_
 #define _LISS_T_
 
+#include <stddef.h>
+
 #include "globals.h"
 #include "vector.h"
 
-vec3_t liss_pos(real_t t, int i);
+/* sets of paths */
+#define LISS_PLANE 0  /* in the z = 0 plane */
+#define LISS_VOLUME 1 /* tilted and moving up and down too */
+
+vec3_t liss_pos(real_t t, int set, int i);
+const void *liss_params(int set, int i, size_t *size);
 
 #endif /* _LISS_T_ */
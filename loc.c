@@ -0,0 +1,607 @@
+/** @file loc.c
+ *  @brief Headless batch version of `view`
+ *
+ *  Computes the same steered-response field as `view`, but on the CPU, for
+ *  every frame of the input as fast as possible, and writes the heatmaps and
+ *  peak positions to disk. With -q it skips the heatmaps and finds the
+ *  peaks with a coarse-to-fine search instead of evaluating every cell, which
+ *  is also how it searches a volume with -z. With -b it only finds the
+ *  bearings of far-away sources.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "array.h"
+#include "doa.h"
+#include "field.h"
+#include "globals.h"
+#include "locate.h"
+#include "pool.h"
+#include "search.h"
+#include "stream.h"
+#include "vector.h"
+#include "whiten.h"
+
+#define XRES 240
+#define YRES 240
+#define WIDTH 12.0 /* meters */
+#define HEIGHT 12.0
+
+#define XCOR_LEN 512 /* samples */
+#define XCOR_MUL 4 /* super-resolution factor */
+#define MAX_SOURCES 16
+#define PEAK_RADIUS 0.5 /* minimum distance between reported sources, in meters */
+#define COARSE_SIZE 0.5 /* largest box of the coarse-to-fine search, in meters */
+#define BEARING_SEP 10.0 /* minimum angle between reported bearings, in degrees */
+
+static array_t array;
+
+/* inputs are streamed; each batch of frames is read into the windows, as
+ * 16-bit samples that are only converted when locate gathers them
+ */
+static stream_t mic_stream[ARRAY_MICS_MAX];
+static int n_streams;
+static int16_t *mic_win[ARRAY_MICS_MAX];
+
+/* one frame of the field, split into bands of rows */
+struct field_job {
+	field_t *field;
+	const real_t *xcor;
+	int n_bands;
+};
+
+static void field_job(void *arg, int band, int worker)
+{
+	struct field_job *job = arg;
+	int yres = job->field->yres;
+
+	field_rows(job->field, job->xcor, yres * band / job->n_bands,
+	           yres * (band + 1) / job->n_bands);
+}
+
+/* a batch of frames searched coarse to fine, a frame per job */
+struct search_job {
+	search_t *searches; /* one per worker */
+	const real_t *xcor;
+	size_t row_size;
+	int n_sources;
+	field_peak_t (*peaks)[MAX_SOURCES];
+	int *n_peaks;
+};
+
+static void search_job(void *arg, int frame, int worker)
+{
+	struct search_job *job = arg;
+
+	job->n_peaks[frame] = search_peaks(&job->searches[worker], job->xcor + job->row_size * frame,
+	                                   job->n_sources, PEAK_RADIUS, job->peaks[frame]);
+}
+
+/** @brief Fills in the frame offsets of the next batch of frames
+ *  @param offsets Output; sample offset of each frame
+ *  @param first First frame of batch
+ *  @param n_frames Total number of frames
+ *  @param batch Maximum number of frames in batch
+ *  @param hop Hop between frames, in samples
+ *  @return Number of frames in batch
+ */
+static int next_batch(size_t *offsets, size_t first, size_t n_frames, int batch, size_t hop)
+{
+	int n = n_frames - first < batch ? n_frames - first : batch;
+
+	for (int i = 0; i < n; i++) {
+		offsets[i] = (first + i) * hop;
+	}
+
+	return n;
+}
+
+/** @brief Gets the number of samples of each input a batch of frames needs
+ *  @param batch Maximum number of frames in a batch
+ *  @param hop Hop between frames, in samples
+ *  @return Window length, in samples
+ */
+static size_t window_len(int batch, size_t hop)
+{
+	return (batch - 1) * (hop < XCOR_LEN ? hop : XCOR_LEN) + XCOR_LEN;
+}
+
+/** @brief Reads the samples a batch of frames covers into the windows
+ *  @param offsets Sample offset of each frame in the inputs
+ *  @param n Number of frames in batch
+ *  @param hop Hop between frames, in samples
+ *  @param win_offsets Output; offset of each frame in the windows
+ *  @return 0 on success, negative on failure
+ *
+ *  Overlapping frames share one contiguous window, otherwise frames are
+ *  packed next to each other.
+ */
+static int load_windows(const size_t *offsets, int n, size_t hop, size_t *win_offsets)
+{
+	int16_t *dst[ARRAY_MICS_MAX];
+
+	if (hop < XCOR_LEN) {
+		if (stream_read_array(mic_stream, n_streams, offsets[0], (n - 1) * hop + XCOR_LEN,
+		                      mic_win) < 0) {
+			return -1;
+		}
+	} else {
+		for (int f = 0; f < n; f++) {
+			for (int i = 0; i < array.n_mics; i++) {
+				dst[i] = mic_win[i] + f * XCOR_LEN;
+			}
+			if (stream_read_array(mic_stream, n_streams, offsets[f], XCOR_LEN, dst) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	for (int f = 0; f < n; f++) {
+		win_offsets[f] = f * (hop < XCOR_LEN ? hop : XCOR_LEN);
+	}
+	return 0;
+}
+
+/** @brief Writes the field as an 8-bit PGM image, normalized to its maximum
+ *  @param filename Name of file to write
+ *  @param f Field to write
+ *  @return 0 on success, negative on failure
+ */
+static int write_pgm(const char *filename, const field_t *f)
+{
+	size_t n = (size_t)f->xres * f->yres;
+	real_t max = 0.0;
+	uint8_t *pix;
+	FILE *fp;
+
+	for (size_t i = 0; i < n; i++) {
+		max = f->map[i] > max ? f->map[i] : max;
+	}
+	real_t scale = max > 0.0 ? 255.0 / max : 0.0;
+
+	pix = malloc(n);
+	if (pix == NULL) {
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		pix[i] = (uint8_t)(f->map[i] * scale);
+	}
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: could not open output file: %s\n", filename, strerror(errno));
+		free(pix);
+		return -1;
+	}
+	fprintf(fp, "P5\n%d %d\n255\n", f->xres, f->yres);
+	if (fwrite(pix, 1, n, fp) < n) {
+		fprintf(stderr, "warning: %s: short write\n", filename);
+	}
+	fclose(fp);
+	free(pix);
+	return 0;
+}
+
+/** @brief Writes the refined TDOA of every mic pair for every frame
+ *  @param prefix Output file prefix; output goes to prefix.tdoa
+ *  @param n_frames Number of frames
+ *  @param hop Hop between frames, in samples
+ *  @param sample_rate Sample rate, in Hz
+ *  @param n_pairs Number of mic pairs
+ *  @param batch Number of frames to process at once
+ *  @return Exit status
+ *
+ *  Each line is the frame number and time, then the lag (in seconds,
+ *  positive if the sound reached the second mic first) and correlation of
+ *  each pair.
+ */
+static int write_tdoa(const char *prefix, size_t n_frames, size_t hop,
+                      int32_t sample_rate, int n_pairs, int batch)
+{
+	locate_peak_t *peaks = malloc((size_t)batch * n_pairs * sizeof(peaks[0]));
+	size_t *offsets = malloc(batch * sizeof(offsets[0]));
+	size_t *win_offsets = malloc(batch * sizeof(win_offsets[0]));
+	char buf[256];
+	int n;
+
+	if (peaks == NULL || offsets == NULL || win_offsets == NULL) {
+		fprintf(stderr, "can't allocate peaks\n");
+		return 1;
+	}
+
+	snprintf(buf, 256, "%s.tdoa", prefix);
+	FILE *fp = fopen(buf, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: could not open output file: %s\n", buf, strerror(errno));
+		return 1;
+	}
+
+	for (size_t frame = 0; frame < n_frames; frame += n) {
+		n = next_batch(offsets, frame, n_frames, batch, hop);
+		if (load_windows(offsets, n, hop, win_offsets) < 0) {
+			fclose(fp);
+			return 1;
+		}
+		locate_peaks_frames(mic_win, win_offsets, n, peaks);
+
+		for (int f = 0; f < n; f++) {
+			const locate_peak_t *p = peaks + (size_t)n_pairs * f;
+			fprintf(fp, "%lu %.4f", frame + f,
+			        (offsets[f] + XCOR_LEN / 2) / (double)sample_rate);
+			for (int i = 0; i < n_pairs; i++) {
+				fprintf(fp, " %.8f %.3f", p[i].lag / sample_rate, p[i].value);
+			}
+			fprintf(fp, "\n");
+		}
+	}
+
+	fclose(fp);
+	free(peaks);
+	free(offsets);
+	free(win_offsets);
+	printf("%lu frames written\n", n_frames);
+	return 0;
+}
+
+/** @brief Writes the bearings of far-away sources for every frame
+ *  @param prefix Output file prefix; output goes to prefix.bearings
+ *  @param doa Grid of directions
+ *  @param n_frames Number of frames
+ *  @param hop Hop between frames, in samples
+ *  @param sample_rate Sample rate, in Hz
+ *  @param n_sources Number of bearings to find per frame
+ *  @param batch Number of frames to process at once
+ *  @return Exit status
+ *
+ *  Each line is the frame number and time, then the azimuth (and elevation,
+ *  if the grid has any) in degrees and score of each source.
+ */
+static int write_bearings(const char *prefix, const doa_t *doa, size_t n_frames, size_t hop,
+                          int32_t sample_rate, int n_sources, int batch)
+{
+	size_t row_size = (size_t)doa->n_pairs * doa->xcor_len;
+	real_t *xcor = malloc((size_t)batch * row_size * sizeof(xcor[0]));
+	real_t *map = malloc((size_t)doa->n_az * doa->n_el * sizeof(map[0]));
+	size_t *offsets = malloc(batch * sizeof(offsets[0]));
+	size_t *win_offsets = malloc(batch * sizeof(win_offsets[0]));
+	doa_peak_t peaks[MAX_SOURCES];
+	char buf[256];
+	int n;
+
+	if (xcor == NULL || map == NULL || offsets == NULL || win_offsets == NULL) {
+		fprintf(stderr, "can't allocate cross-correlation buffers\n");
+		return 1;
+	}
+
+	snprintf(buf, 256, "%s.bearings", prefix);
+	FILE *fp = fopen(buf, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: could not open output file: %s\n", buf, strerror(errno));
+		return 1;
+	}
+
+	for (size_t frame = 0; frame < n_frames; frame += n) {
+		n = next_batch(offsets, frame, n_frames, batch, hop);
+		if (load_windows(offsets, n, hop, win_offsets) < 0) {
+			fclose(fp);
+			return 1;
+		}
+		locate_xcor_frames(mic_win, win_offsets, n, xcor);
+
+		/* the scan is cheap next to the correlations, so it isn't split */
+		for (int f = 0; f < n; f++) {
+			doa_scan(doa, xcor + row_size * f, map);
+			int n_peaks = doa_peaks(doa, map, n_sources, BEARING_SEP, peaks);
+
+			fprintf(fp, "%lu %.4f", frame + f,
+			        (offsets[f] + XCOR_LEN / 2) / (double)sample_rate);
+			for (int i = 0; i < n_peaks; i++) {
+				if (doa->n_el > 1) {
+					fprintf(fp, " %.1f %.1f %.3f", peaks[i].az, peaks[i].el, peaks[i].score);
+				} else {
+					fprintf(fp, " %.1f %.3f", peaks[i].az, peaks[i].score);
+				}
+			}
+			fprintf(fp, "\n");
+		}
+	}
+
+	fclose(fp);
+	free(xcor);
+	free(map);
+	free(offsets);
+	free(win_offsets);
+	printf("%lu frames written\n", n_frames);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] <input> <output_prefix> <n_sources>\n"
+		"  <input> is a WAV with a channel per mic or the prefix of <input>.0.wav,\n"
+		"  <input>.1.wav...\n"
+		"  -a <file> mic array geometry (default: built-in 12-mic star)\n"
+		"  -j <n>    number of worker threads (default: number of cores)\n"
+		"  -s <n>    hop between frames, in samples (default: %d)\n"
+		"  -r <n>    field resolution, in cells per side (default: %d)\n"
+		"  -p <p>    mic pairs: ring, all, or a list like 0-1,0-6 (default: the\n"
+		"            array's, or ring)\n"
+		"  -l <l>    max lag in samples, \"auto\" to derive from mic spacing or\n"
+		"            \"full\" for all lags (default: auto)\n"
+		"  -P <e>    FFT planning effort: estimate, measure or patient (default: measure)\n"
+		"  -f <l-h>  only correlate frequencies from l to h Hz (default: all)\n"
+		"  -n        don't write heatmaps, only peaks\n"
+		"  -q        find peaks by coarse-to-fine search, without heatmaps\n"
+		"  -k <n>    coarse boxes searched per source with -q (default: %d)\n"
+		"  -z <d>    search a volume <d> m deep, centred on the array's plane,\n"
+		"            rather than the plane; implies -q\n"
+		"  -b <a>[,<e>]  only write bearings of far-away sources, on a grid of\n"
+		"            azimuths <a> degrees apart and, if given, elevations <e> apart\n"
+		"  -t        only write refined per-pair TDOAs, no field or peaks\n",
+		name, XCOR_LEN / 2, XRES, SEARCH_BEAM_DEFAULT);
+}
+
+int main(int argc, char **argv)
+{
+	char buf[256];
+	int32_t sample_rate;
+	size_t n_samples, n_frames, hop = XCOR_LEN / 2;
+	int opt, n_sources, res = XRES, write_maps = 1, tdoa_only = 0, n_threads = 0;
+	int quick = 0, beam = SEARCH_BEAM_DEFAULT, zres = 1;
+	double depth = 0.0, az_step = 0.0, el_step = 0.0;
+	int effort = LOCATE_PLAN_MEASURE, n_pairs;
+	const char *pair_spec = NULL, *lag_spec = "auto", *band_spec = NULL, *array_file = NULL;
+	locate_pair_t *pairs;
+	int *max_lag = NULL;
+	real_t weight[XCOR_LEN + 1];
+	field_t field;
+	search_t *searches = NULL;
+	pool_t *pool;
+
+	while ((opt = getopt(argc, argv, "a:j:s:r:p:l:P:f:nqk:z:b:t")) != -1) {
+		switch (opt) {
+		case 'a': array_file = optarg; break;
+		case 'j': n_threads = atoi(optarg); break;
+		case 's': hop = (size_t)atol(optarg); break;
+		case 'r': res = atoi(optarg); break;
+		case 'p': pair_spec = optarg; break;
+		case 'l': lag_spec = optarg; break;
+		case 'f': band_spec = optarg; break;
+		case 'P':
+			effort = !strcmp(optarg, "estimate") ? LOCATE_PLAN_ESTIMATE :
+			         !strcmp(optarg, "measure")  ? LOCATE_PLAN_MEASURE :
+			         !strcmp(optarg, "patient")  ? LOCATE_PLAN_PATIENT : -1;
+			break;
+		case 'n': write_maps = 0; break;
+		case 'q': quick = 1; write_maps = 0; break;
+		case 'k': beam = atoi(optarg); break;
+		case 'z': depth = atof(optarg); quick = 1; write_maps = 0; break;
+		case 'b':
+			if (sscanf(optarg, "%lf,%lf", &az_step, &el_step) < 1 || az_step <= 0.0 ||
+			    el_step < 0.0) {
+				az_step = -1.0;
+			}
+			break;
+		case 't': tdoa_only = 1; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (argc - optind < 3 || hop == 0 || res < 1 || beam < 1 || depth < 0.0 || az_step < 0.0 ||
+	    effort < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (array_file == NULL) {
+		array_default(&array);
+	} else if (array_load(array_file, &array) < 0) {
+		return 1;
+	}
+	if (pair_spec == NULL) {
+		pair_spec = array.pairs[0] ? array.pairs : "ring";
+	}
+	pairs = locate_pairs(pair_spec, array.n_mics, &n_pairs);
+	if (pairs == NULL) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* cells as deep as they are wide */
+	if (depth > 0.0) {
+		zres = (int)(res * depth / WIDTH + 0.5);
+		zres = zres < 2 ? 2 : zres;
+	}
+
+	n_sources = atoi(argv[optind + 2]);
+	n_sources = n_sources < 1 ? 1 : n_sources > MAX_SOURCES ? MAX_SOURCES : n_sources;
+
+	pool = pool_create(n_threads < 1 ? 0 : n_threads > res ? res : n_threads);
+	if (pool == NULL) {
+		fprintf(stderr, "can't create worker threads\n");
+		return 1;
+	}
+	n_threads = pool_size(pool);
+
+	/* open inputs - one multichannel file or a file per mic */
+	n_streams = stream_open_array(mic_stream, argv[optind], array.n_mics,
+	                              window_len(n_threads, hop));
+	if (n_streams < 0) {
+		return 1;
+	}
+	for (int i = 0; i < array.n_mics; i++) {
+		mic_win[i] = malloc(window_len(n_threads, hop) * sizeof(mic_win[i][0]));
+		if (mic_win[i] == NULL) {
+			fprintf(stderr, "can't allocate input windows\n");
+			return 1;
+		}
+	}
+	sample_rate = mic_stream[0].info.rate;
+	n_samples = mic_stream[0].info.len;
+	n_frames = n_samples < XCOR_LEN ? 0 : (n_samples - XCOR_LEN) / hop + 1;
+
+	/* only compute lags that can actually happen */
+	if (!strcmp(lag_spec, "auto")) {
+		max_lag = locate_max_lags(array.pos, array.delay, pairs, n_pairs, sample_rate);
+	} else if (strcmp(lag_spec, "full")) {
+		if ((max_lag = malloc(n_pairs * sizeof(max_lag[0]))) != NULL) {
+			for (int i = 0; i < n_pairs; i++) {
+				max_lag[i] = atoi(lag_spec);
+			}
+		}
+	}
+
+	/* band limit - bin k of the 2 * XCOR_LEN point transforms is at
+	 * k * rate / (2 * XCOR_LEN) Hz
+	 */
+	if (band_spec != NULL) {
+		double lo, hi;
+		if (sscanf(band_spec, "%lf-%lf", &lo, &hi) != 2 || lo >= hi) {
+			usage(argv[0]);
+			return 1;
+		}
+		for (int k = 0; k <= XCOR_LEN; k++) {
+			double f = k * (double)sample_rate / (2 * XCOR_LEN);
+			weight[k] = f >= lo && f <= hi ? 1.0 : 0.0;
+		}
+	}
+
+	/* TDOAs only need the peaks, which are refined from native-resolution
+	 * correlations instead of super-resolving everything
+	 */
+	locate_cfg_t cfg = {
+		.n_samples = XCOR_LEN,
+		.n_mics = array.n_mics,
+		.upres = tdoa_only ? 1 : XCOR_MUL,
+		.pairs = pairs,
+		.n_pairs = n_pairs,
+		.max_lag = max_lag,
+		.effort = effort,
+		.refine = LOCATE_REFINE_SINC,
+		.pool = pool,
+		.weight = band_spec != NULL ? weight : NULL,
+		.samples = LOCATE_SAMPLES_INT16,
+	};
+	if (locate_init(&cfg) < 0) {
+		fprintf(stderr, "locate init failed\n");
+		return 1;
+	}
+
+	printf("rate %d, %lu samples, %d pairs, %d threads, %s whitening\n", sample_rate,
+	       n_samples, n_pairs, n_threads, whiten_name());
+
+	if (tdoa_only) {
+		return write_tdoa(argv[optind + 1], n_frames, hop, sample_rate, n_pairs, n_threads);
+	}
+	if (az_step > 0.0) {
+		doa_t doa;
+
+		if (doa_init(&doa, az_step, el_step, &array, pairs, n_pairs, locate_row_len(),
+		             (sample_rate * XCOR_MUL) / SND_SPEED) < 0) {
+			fprintf(stderr, "can't set up direction grid\n");
+			return 1;
+		}
+		return write_bearings(argv[optind + 1], &doa, n_frames, hop, sample_rate, n_sources,
+		                      n_threads);
+	}
+	if (quick) {
+		int grid[3] = { res, res, zres };
+		real_t size[3] = { WIDTH, HEIGHT, depth };
+
+		searches = malloc(n_threads * sizeof(searches[0]));
+		for (int i = 0; searches != NULL && i < n_threads; i++) {
+			if (search_init(&searches[i], grid, size, COARSE_SIZE, beam, &array, pairs,
+			                n_pairs, locate_row_len(),
+			                (sample_rate * XCOR_MUL) / SND_SPEED) < 0) {
+				free(searches);
+				searches = NULL;
+			}
+		}
+		if (searches == NULL) {
+			fprintf(stderr, "can't allocate search\n");
+			return 1;
+		}
+	} else if (field_init(&field, res, res, WIDTH, HEIGHT, &array, pairs, n_pairs,
+	                      locate_row_len(), (sample_rate * XCOR_MUL) / SND_SPEED) < 0) {
+		fprintf(stderr, "can't allocate field\n");
+		return 1;
+	}
+
+	snprintf(buf, 256, "%s.peaks", argv[optind + 1]);
+	FILE *peaks_fp = fopen(buf, "w");
+	if (peaks_fp == NULL) {
+		fprintf(stderr, "%s: could not open output file: %s\n", buf, strerror(errno));
+		return 1;
+	}
+
+	/* correlate one frame per worker at a time, then split the field of
+	 * each frame among the workers, or search a frame per worker
+	 */
+	size_t row_size = (size_t)n_pairs * locate_row_len();
+	real_t *xcor_res = malloc((size_t)n_threads * row_size * sizeof(xcor_res[0]));
+	size_t *offsets = malloc(n_threads * sizeof(offsets[0]));
+	size_t *win_offsets = malloc(n_threads * sizeof(win_offsets[0]));
+	field_peak_t (*peaks)[MAX_SOURCES] = malloc(n_threads * sizeof(peaks[0]));
+	int *n_peaks = malloc(n_threads * sizeof(n_peaks[0]));
+	if (xcor_res == NULL || offsets == NULL || win_offsets == NULL || peaks == NULL ||
+	    n_peaks == NULL) {
+		fprintf(stderr, "can't allocate cross-correlation buffers\n");
+		return 1;
+	}
+
+	int n;
+	for (size_t frame = 0; frame < n_frames; frame += n) {
+		n = next_batch(offsets, frame, n_frames, n_threads, hop);
+		if (load_windows(offsets, n, hop, win_offsets) < 0) {
+			fclose(peaks_fp);
+			return 1;
+		}
+		locate_xcor_frames(mic_win, win_offsets, n, xcor_res);
+
+		if (quick) {
+			struct search_job job = { searches, xcor_res, row_size, n_sources, peaks, n_peaks };
+			pool_run(pool, n, search_job, &job);
+		}
+
+		for (int f = 0; f < n; f++) {
+			if (!quick) {
+				struct field_job job = { &field, xcor_res + row_size * f, n_threads };
+				pool_run(pool, n_threads, field_job, &job);
+				n_peaks[f] = field_peaks(&field, n_sources, PEAK_RADIUS, peaks[f]);
+			}
+			if (n_peaks[f] < 0) {
+				fprintf(stderr, "can't allocate search\n");
+				fclose(peaks_fp);
+				return 1;
+			}
+
+			/* time is the middle of the frame, as in `view` */
+			fprintf(peaks_fp, "%lu %.4f", frame + f,
+			        (offsets[f] + XCOR_LEN / 2) / (double)sample_rate);
+			for (int i = 0; i < n_peaks[f]; i++) {
+				const field_peak_t *p = &peaks[f][i];
+				if (depth > 0.0) {
+					fprintf(peaks_fp, " %.3f %.3f %.3f %.3f", p->x, p->y, p->z, p->score);
+				} else {
+					fprintf(peaks_fp, " %.3f %.3f %.3f", p->x, p->y, p->score);
+				}
+			}
+			fprintf(peaks_fp, "\n");
+
+			if (write_maps) {
+				snprintf(buf, 256, "%s.%06lu.pgm", argv[optind + 1], frame + f);
+				write_pgm(buf, &field);
+			}
+		}
+	}
+
+	fclose(peaks_fp);
+	printf("%lu frames written\n", n_frames);
+	return 0;
+}
@@ -4,151 +4,1214 @@
 
 #include <complex.h>
 #include <fftw3.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "file.h"
 #include "globals.h"
 #include "locate.h"
+#include "pool.h"
+#include "vector.h"
+#include "whiten.h"
+
+#if defined(__SSE2__) && !defined(USE_DOUBLE)
+#include <emmintrin.h>
+#endif
 
 #ifndef USE_DOUBLE
 #define fftw_plan fftwf_plan
-#define fftw_plan_many_dft fftwf_plan_many_dft
+#define fftw_plan_many_dft_r2c fftwf_plan_many_dft_r2c
+#define fftw_plan_many_dft_c2r fftwf_plan_many_dft_c2r
+#define fftw_destroy_plan fftwf_destroy_plan
+#define fftw_alloc_real fftwf_alloc_real
 #define fftw_alloc_complex fftwf_alloc_complex
-#define fftw_execute fftwf_execute
+#define fftw_free fftwf_free
+#define fftw_execute_dft_r2c fftwf_execute_dft_r2c
+#define fftw_execute_dft_c2r fftwf_execute_dft_c2r
 #define fftw_complex fftwf_complex
+#define fftw_import_wisdom_from_filename fftwf_import_wisdom_from_filename
+#define fftw_export_wisdom_to_filename fftwf_export_wisdom_to_filename
+#define WISDOM_PRECISION "f"
+#else
+#define WISDOM_PRECISION "d"
 #endif
 
-static struct fft {
+#define WISDOM_DIR_ENV "LOC_WISDOM_DIR"
+
+/* FFTW planner flags for each LOCATE_PLAN_* effort level */
+static const unsigned plan_flags[] = {
+	[LOCATE_PLAN_ESTIMATE] = FFTW_ESTIMATE,
+	[LOCATE_PLAN_MEASURE]  = FFTW_MEASURE,
+	[LOCATE_PLAN_PATIENT]  = FFTW_PATIENT,
+};
+
+/* FFTW plans are shared by every context with the same transform; each
+ * context runs them on its own buffers with the new-array execute functions.
+ * The planner isn't thread-safe, so everything touching it holds
+ * `planner_lock`.
+ */
+struct plan_ref {
 	fftw_plan plan;
-	fftw_complex *in, *out;
-	int len;
-} fft_f, fft_r;
+	int direction, len, count;
+	unsigned flags;
+	int refs;
+	struct plan_ref *next;
+};
 
-static int fft_count, fft_data_len, fft_out_len, fft_upres;
+static struct plan_ref *plan_cache;
+static pthread_mutex_t planner_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/** @brief Initializes a single FFT
- *  @param fft FFT to initialize
- *  @param len Length of FFT to initialize
- *  @param direction Direction of FFT (FFTW_FORWARD or FFTW_BACKWARD)
+/* transforms in a batch start on cache line boundaries, so every chunk of
+ * a batch has the same alignment as the start of the buffer
+ */
+#define ROW_ALIGN 64
+
+/* real transforms only need the Hermitian half of the spectrum */
+struct fft {
+	real_t *real;
+	fftw_complex *cplx;
+	int len;       /* transform length (real side) */
+	int cplx_len;  /* len / 2 + 1 */
+	int real_dist; /* distance between transforms, padded to ROW_ALIGN */
+	int cplx_dist;
+	int count;     /* number of transforms in batch */
+
+	/* batch split into chunks that can run on different workers - chunk i
+	 * is transforms chunk[i] to chunk[i + 1] - 1, planned as one batch
+	 */
+	int n_chunks;
+	int *chunk;
+	struct plan_ref **chunk_plan;
+};
+
+struct locate_ctx {
+	struct fft fft_f, fft_r;
+	int data_len, out_len, upres;
+	int samples; /* input format, LOCATE_SAMPLES_* */
+
+	/* mic pairs to correlate - one inverse FFT and one output row each */
+	locate_pair_t *pairs;
+
+	/* output window - row i holds lags -lag[i] to lag[i] (in super-resolved
+	 * samples) centered on index row_len / 2
+	 */
+	int *lag, lag_max, row_len;
+
+	/* whitened cross-spectrum of each pair (interleaved, `fft_f.cplx_len`
+	 * bins per row), and optional weight of each bin
+	 */
+	real_t *dir_spec, *weight;
+
+	/* pruned inverse DFT, used instead of the inverse FFT when few enough
+	 * lags are needed - the table has one row of `fft_f.cplx_len`
+	 * interleaved (cos, sin) pairs per lag, with bin weights folded in
+	 */
+	int direct;
+	real_t *dir_tab;
+	int own_tables; /* 0 if the table belongs to a parent context */
+
+	/* peak refinement for `locate_ctx_peaks` - needs `dir_spec` for
+	 * LOCATE_REFINE_SINC
+	 */
+	int refine;
+	real_t *peak_rows;
+
+	/* workers to split frames among, and one serial context per worker for
+	 * `locate_ctx_xcor_frames` (created on first use from `cfg`)
+	 */
+	pool_t *pool;
+	locate_ctx_t **lanes;
+	locate_cfg_t cfg;
+	int *cfg_max_lag;
+};
+
+/* one `locate_ctx_xcor` or `locate_ctx_peaks` call - jobs are chunks */
+struct xcor_job {
+	locate_ctx_t *ctx;
+	const void *data;
+	size_t data_offset;
+	real_t *res;
+	locate_peak_t *peaks; /* NULL if only the correlation is wanted */
+};
+
+/* one `locate_ctx_xcor_frames` or `locate_ctx_peaks_frames` call - jobs are
+ * frames
+ */
+struct frames_job {
+	locate_ctx_t *ctx;
+	const void *data;
+	const size_t *offsets;
+	real_t *res;
+	locate_peak_t *peaks;
+};
+
+/* context behind `locate_init`, `locate_xcor` etc. */
+static locate_ctx_t *default_ctx;
+
+static locate_ctx_t *ctx_create(const locate_cfg_t *cfg, const locate_ctx_t *parent);
+static void find_peak(const locate_ctx_t *ctx, int pair, locate_peak_t *peak);
+
+/** @brief Rounds a row length up so that rows start on ROW_ALIGN boundaries
+ *  @param len Row length, in elements
+ *  @param size Element size, in bytes
+ *  @return Padded row length, in elements
+ */
+static int pad_row(int len, size_t size)
+{
+	int per = ROW_ALIGN / size;
+	return (len + per - 1) / per * per;
+}
+
+/** @brief Plans a batch of real FFTs
+ *  @param fft FFT to plan; buffers and lengths must already be set up
+ *  @param count Number of transforms in the batch
+ *  @param direction Direction of FFT - FFTW_FORWARD for real-to-complex,
+ *                   FFTW_BACKWARD for complex-to-real
+ *  @param flags FFTW planner flags
+ *  @return FFTW plan, or NULL on failure
+ */
+static fftw_plan plan_fft(struct fft *fft, int count, int direction, unsigned flags)
+{
+	if (direction == FFTW_FORWARD) {
+		return fftw_plan_many_dft_r2c(1,              /* rank */
+		                              &fft->len,      /* dimensions */
+		                              count,          /* number of FFTs */
+
+		                              /* buffer, embed, stride, distance */
+		                              fft->real, NULL, 1, fft->real_dist, /* input */
+		                              fft->cplx, NULL, 1, fft->cplx_dist, /* output */
+
+		                              flags);         /* flags */
+	}
+
+	return fftw_plan_many_dft_c2r(1, &fft->len, count,
+	                              fft->cplx, NULL, 1, fft->cplx_dist, /* input */
+	                              fft->real, NULL, 1, fft->real_dist, /* output */
+	                              flags);
+}
+
+/** @brief Gets a shared plan for a batch of FFTs, planning it if needed
+ *  @param fft FFT to plan; buffers and lengths must already be set up
+ *  @param count Number of transforms in the batch
+ *  @param direction Direction of FFT
+ *  @param flags FFTW planner flags
+ *  @param have_wisdom Whether wisdom for this FFT may have been loaded
+ *  @param ref_out Output; shared plan
+ *  @return 1 if new wisdom was generated, 0 if not, negative on failure
+ *
+ *  Must be called with `planner_lock` held. If wisdom was loaded, first
+ *  tries to plan from wisdom alone; stale or missing wisdom falls back to
+ *  planning from scratch. Row distances follow from the length, so the
+ *  length and count are enough to identify a plan.
+ */
+static int get_plan(struct fft *fft, int count, int direction, unsigned flags,
+                    int have_wisdom, struct plan_ref **ref_out)
+{
+	struct plan_ref *ref;
+	int new_wisdom = 0;
+
+	for (ref = plan_cache; ref != NULL; ref = ref->next) {
+		if (ref->direction == direction && ref->len == fft->len &&
+		    ref->count == count && ref->flags == flags) {
+			ref->refs++;
+			*ref_out = ref;
+			return 0;
+		}
+	}
+
+	ref = malloc(sizeof(*ref));
+	if (ref == NULL) {
+		return -1;
+	}
+
+	ref->plan = NULL;
+	if (have_wisdom) {
+		ref->plan = plan_fft(fft, count, direction, flags | FFTW_WISDOM_ONLY);
+	}
+	if (ref->plan == NULL) {
+		ref->plan = plan_fft(fft, count, direction, flags);
+		new_wisdom = !(flags & FFTW_ESTIMATE);
+	}
+	if (ref->plan == NULL) {
+		free(ref);
+		return -1;
+	}
+
+	ref->direction = direction;
+	ref->len = fft->len;
+	ref->count = count;
+	ref->flags = flags;
+	ref->refs = 1;
+	ref->next = plan_cache;
+	plan_cache = ref;
+	*ref_out = ref;
+	return new_wisdom;
+}
+
+/** @brief Releases a shared plan, destroying it once nothing uses it
+ *  @param ref Plan to release, may be NULL
+ *
+ *  Must be called with `planner_lock` held.
+ */
+static void put_plan(struct plan_ref *ref)
+{
+	struct plan_ref **p;
+
+	if (ref == NULL || --ref->refs > 0) {
+		return;
+	}
+
+	for (p = &plan_cache; *p != NULL; p = &(*p)->next) {
+		if (*p == ref) {
+			*p = ref->next;
+			break;
+		}
+	}
+	fftw_destroy_plan(ref->plan);
+	free(ref);
+}
+
+/** @brief Splits a batch of transforms into chunks
+ *  @param fft FFT to split
+ *  @param count Number of transforms in batch
+ *  @param n_chunks Number of chunks; limited to `count`
  *  @return 0 on success, negative on failure
  */
-static int init_fft(struct fft *fft, int len, int direction)
+static int split_fft(struct fft *fft, int count, int n_chunks)
 {
+	fft->count = count;
+	fft->n_chunks = n_chunks < count ? n_chunks : count;
+	fft->chunk = malloc((fft->n_chunks + 1) * sizeof(fft->chunk[0]));
+	if (fft->chunk == NULL) {
+		return -1;
+	}
+
+	for (int i = 0; i <= fft->n_chunks; i++) {
+		fft->chunk[i] = count * i / fft->n_chunks;
+	}
+
+	return 0;
+}
+
+/** @brief Initializes a batch of real FFTs
+ *  @param fft FFT to initialize; must already be split with `split_fft`
+ *  @param len Length of FFT to initialize
+ *  @param direction Direction of FFT - FFTW_FORWARD for real-to-complex,
+ *                   FFTW_BACKWARD for complex-to-real
+ *  @param flags FFTW planner flags
+ *  @param have_wisdom Whether wisdom for this FFT may have been loaded
+ *  @return 1 if new wisdom was generated, 0 if not, negative on failure
+ *
+ *  Must be called with `planner_lock` held. Buffers come from FFTW's
+ *  allocator so that they have the alignment a shared plan expects. Each
+ *  chunk gets a plan of its own size; with at most two different chunk
+ *  sizes, that is at most two plans.
+ */
+static int init_fft(struct fft *fft, int len, int direction, unsigned flags, int have_wisdom)
+{
+	int new_wisdom = 0, count = fft->count;
+
 	fft->len = len;
-	fft->in = fftw_alloc_complex(len * fft_count);
-	fft->out = fftw_alloc_complex(len * fft_count);
+	fft->cplx_len = len / 2 + 1;
+	fft->real_dist = pad_row(fft->len, sizeof(*(fft->real)));
+	fft->cplx_dist = pad_row(fft->cplx_len, sizeof(*(fft->cplx)));
+	fft->real = fftw_alloc_real((size_t)fft->real_dist * count);
+	fft->cplx = fftw_alloc_complex((size_t)fft->cplx_dist * count);
+	fft->chunk_plan = calloc(fft->n_chunks, sizeof(fft->chunk_plan[0]));
 
-	if (fft->in == NULL || fft->in == NULL) {
+	if (fft->real == NULL || fft->cplx == NULL || fft->chunk_plan == NULL) {
 		return -1;
 	}
 
-	fft->plan = fftw_plan_many_dft(1,              /* rank */
-	                               &fft->len,      /* dimensions */
-	                               fft_count,      /* number of FFTs */
+	for (int i = 0; i < fft->n_chunks; i++) {
+		int ret = get_plan(fft, fft->chunk[i + 1] - fft->chunk[i], direction, flags,
+		                   have_wisdom, &fft->chunk_plan[i]);
+		if (ret < 0) {
+			return -1;
+		}
+		new_wisdom |= ret;
+	}
 
-	                               /* buffer, embed, stride, distance */
-	                               fft->in , NULL, 1, len, /* input */
-	                               fft->out, NULL, 1, len, /* output */
+	/* measuring planners scribble over the buffers */
+	memset(fft->real, 0, (size_t)fft->real_dist * count * sizeof(*(fft->real)));
+	memset(fft->cplx, 0, (size_t)fft->cplx_dist * count * sizeof(*(fft->cplx)));
+	return new_wisdom;
+}
 
-	                               direction,      /* direction */
-	                               FFTW_ESTIMATE); /* flags */
+/** @brief Frees a batch of real FFTs
+ *  @param fft FFT to free
+ *
+ *  Must be called with `planner_lock` held.
+ */
+static void free_fft(struct fft *fft)
+{
+	if (fft->chunk_plan != NULL) {
+		for (int i = 0; i < fft->n_chunks; i++) {
+			put_plan(fft->chunk_plan[i]);
+		}
+	}
+	free(fft->chunk_plan);
+	free(fft->chunk);
+	fftw_free(fft->real);
+	fftw_free(fft->cplx);
+}
+
+/** @brief Initializes the pruned inverse DFT
+ *  @param ctx Context to initialize
+ *  @return 0 on success, negative on failure
+ *
+ *  The inverse of a Hermitian half-spectrum C at lag l is
+ *
+ *  x[l] = sum_k w_k (Re(C_k) cos(2 pi k l / R) - Im(C_k) sin(2 pi k l / R))
+ *
+ *  with w_k = 2 except for the DC and (original) Nyquist bins, where it is 1.
+ *  Since the cosine term is even and the sine term odd in l, one pass over
+ *  the bins gives both x[l] and x[-l]. The table is laid out like the
+ *  interleaved spectrum, so that pass is a single dot product whose even and
+ *  odd terms are the cosine and sine sums.
+ */
+static int init_direct(locate_ctx_t *ctx)
+{
+	int n_bins = ctx->fft_f.cplx_len, len = ctx->fft_r.len;
+
+	ctx->own_tables = 1;
+	ctx->dir_tab = fftw_alloc_real((size_t)(ctx->lag_max + 1) * n_bins * 2);
+	if (ctx->dir_tab == NULL) {
+		return -1;
+	}
+
+	for (int l = 0; l <= ctx->lag_max; l++) {
+		real_t *t = ctx->dir_tab + (size_t)l * n_bins * 2;
+		for (int k = 0; k < n_bins; k++) {
+			double w = (k == 0 || k == n_bins - 1) ? 1.0 : 2.0;
+			double a = 2.0 * M_PI * (double)((long)k * l % len) / (double)len;
+			t[2 * k] = w * cos(a);
+			t[2 * k + 1] = w * sin(a);
+		}
+	}
 
-	memset(fft->in, 0, len * fft_count * sizeof(*(fft->in)));
 	return 0;
 }
 
-/** @brief Initializes locate
- *  @param n_samples Number of samples to take from input data
- *  @param n_mics Number of signals
- *  @param upres_factor Super-resolution factor
+/** @brief Gets the name of the wisdom cache file for a context's FFT sizes
+ *  @param ctx Context to get the cache file for
+ *  @param buf Output; file name
+ *  @param size Size of `buf`
+ *  @return 0 on success, negative if there is nowhere to put the cache
+ *
+ *  The cache lives in $LOC_WISDOM_DIR, or else $XDG_CACHE_HOME/loc or
+ *  ~/.cache/loc, which is created if it doesn't exist. File names include
+ *  the precision, transform sizes and batch counts, since wisdom for one
+ *  configuration is useless for another.
+ */
+static int wisdom_path(const locate_ctx_t *ctx, char *buf, size_t size)
+{
+	char dir[256];
+	int len;
+
+	if (file_cache_dir(WISDOM_DIR_ENV, "loc", dir, sizeof(dir)) < 0) {
+		return -1;
+	}
+
+	len = snprintf(buf, size, "%s/wisdom-%s-r2c%dx%d-c2r%dx%d", dir, WISDOM_PRECISION,
+	               ctx->data_len * 2, ctx->fft_f.count, ctx->out_len * 2, ctx->fft_r.count);
+	return len < size ? 0 : -1;
+}
+
+/** @brief Builds a table of mic pairs
+ *  @param spec "ring" for each mic and the next one (the default), "all" for
+ *              every pair, or a list of pairs like "0-1,0-6,3-9"
+ *  @param n_mics Number of mics
+ *  @param n_pairs_out Output; number of pairs
+ *  @return Array of pairs (free with `free`), or NULL on failure
+ */
+locate_pair_t *locate_pairs(const char *spec, int n_mics, int *n_pairs_out)
+{
+	locate_pair_t *pairs;
+	int n = 0;
+
+	if (n_mics < 2) {
+		return NULL;
+	}
+
+	if (!strcmp(spec, "ring")) {
+		pairs = malloc(n_mics * sizeof(pairs[0]));
+		if (pairs == NULL) {
+			return NULL;
+		}
+		for (n = 0; n < n_mics; n++) {
+			pairs[n].a = n;
+			pairs[n].b = (n + 1) % n_mics;
+		}
+	} else if (!strcmp(spec, "all")) {
+		pairs = malloc(n_mics * (n_mics - 1) / 2 * sizeof(pairs[0]));
+		if (pairs == NULL) {
+			return NULL;
+		}
+		for (int a = 0; a < n_mics; a++) {
+			for (int b = a + 1; b < n_mics; b++, n++) {
+				pairs[n].a = a;
+				pairs[n].b = b;
+			}
+		}
+	} else {
+		/* at most one pair per 4 characters ("0-1,") */
+		pairs = malloc((strlen(spec) / 4 + 1) * sizeof(pairs[0]));
+		if (pairs == NULL) {
+			return NULL;
+		}
+		for (const char *p = spec; *p; n++) {
+			char *end;
+			long a = strtol(p, &end, 10);
+			if (end == p || *end != '-') {
+				goto fail;
+			}
+			p = end + 1;
+			long b = strtol(p, &end, 10);
+			if (end == p || (*end != ',' && *end != '\0') ||
+			    a < 0 || a >= n_mics || b < 0 || b >= n_mics || a == b) {
+				goto fail;
+			}
+			p = *end ? end + 1 : end;
+			pairs[n].a = a;
+			pairs[n].b = b;
+		}
+		if (n == 0) {
+			goto fail;
+		}
+	}
+
+	*n_pairs_out = n;
+	return pairs;
+
+fail:
+	fprintf(stderr, "bad mic pair list: %s\n", spec);
+	free(pairs);
+	return NULL;
+}
+
+/** @brief Finds the maximum physically possible lag of each mic pair
+ *  @param mic_pos Mic positions
+ *  @param mic_delay How late each mic's channel is, in s, or NULL for none
+ *  @param pairs Mic pairs
+ *  @param n_pairs Number of mic pairs
+ *  @param sample_rate Sample rate, in Hz
+ *  @return Array of lags in samples (free with `free`), or NULL on failure
+ *
+ *  A sound can't arrive at one mic of a pair earlier than the time it takes
+ *  to travel from the other mic, give or take the difference in their
+ *  channels' delays. One sample of margin is added for rounding.
+ */
+int *locate_max_lags(const vec3_t *mic_pos, const real_t *mic_delay,
+                     const locate_pair_t *pairs, int n_pairs, real_t sample_rate)
+{
+	int *lags = malloc(n_pairs * sizeof(lags[0]));
+	if (lags == NULL) {
+		return NULL;
+	}
+
+	for (int i = 0; i < n_pairs; i++) {
+		real_t d = vec3_dist(mic_pos[pairs[i].a], mic_pos[pairs[i].b]);
+		real_t skew = mic_delay != NULL ? fabs(mic_delay[pairs[i].a] - mic_delay[pairs[i].b]) : 0.0;
+		lags[i] = (int)ceil((d / SND_SPEED + skew) * sample_rate) + 1;
+	}
+
+	return lags;
+}
+
+/** @brief Creates a locate context
+ *  @param cfg Configuration - see `locate_cfg_t`
+ *  @return New context, or NULL on failure
+ *
+ *  Sets up a context to compute the cross-correlation of `n_pairs` pairs of
+ *  the `n_mics` input signals using `n_samples` samples from each one.
+ *  Contexts are independent of each other and may be used from different
+ *  threads at the same time, one thread per context. FFT plans are shared
+ *  between contexts with the same transform sizes, but every context has its
+ *  own buffers.
+ *
+ *  If `max_lag` is given, only lags up to that in either direction are
+ *  stored. The inverse FFT is replaced by a pruned inverse DFT that
+ *  evaluates just those lags only when that's cheaper by a rough flop count,
+ *  which for a 1 m array takes a window of a few samples; otherwise, as with
+ *  the derived lags, the full inverse FFT is done and the window copied out.
+ *
+ *  If `pool` is given, the mics and pairs of each frame are split into one
+ *  chunk per worker, each transformed as a batch of its own, and batches of
+ *  frames can be run one per worker with `locate_ctx_xcor_frames`.
+ *
+ *  Anything above LOCATE_PLAN_ESTIMATE can take seconds to plan, so plans
+ *  are saved as FFTW wisdom (see `wisdom_path`) and reused by later runs.
+ */
+locate_ctx_t *locate_ctx_create(const locate_cfg_t *cfg)
+{
+	return ctx_create(cfg, NULL);
+}
+
+/** @brief Creates a locate context
+ *  @param cfg Configuration - see `locate_cfg_t`
+ *  @param parent Context to share read-only tables with, or NULL
+ *  @return New context, or NULL on failure
+ */
+static locate_ctx_t *ctx_create(const locate_cfg_t *cfg, const locate_ctx_t *parent)
+{
+	char path[512];
+	int have_path = 0, have_wisdom = 0, new_f, new_r = 0;
+	int n_samples = cfg->n_samples, upres_factor = cfg->upres, n_pairs = cfg->n_pairs;
+	int n_workers = pool_size(cfg->pool);
+	locate_ctx_t *ctx;
+
+	if (cfg->effort < LOCATE_PLAN_ESTIMATE || cfg->effort > LOCATE_PLAN_PATIENT ||
+	    cfg->refine < LOCATE_REFINE_NONE || cfg->refine > LOCATE_REFINE_SINC) {
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	if (cfg->pairs == NULL) {
+		ctx->pairs = locate_pairs("ring", cfg->n_mics, &n_pairs);
+	} else if ((ctx->pairs = malloc(n_pairs * sizeof(ctx->pairs[0]))) != NULL) {
+		memcpy(ctx->pairs, cfg->pairs, n_pairs * sizeof(ctx->pairs[0]));
+	}
+	ctx->lag = malloc(n_pairs * sizeof(ctx->lag[0]));
+	if (ctx->pairs == NULL || ctx->lag == NULL) {
+		goto fail;
+	}
+
+	/* keep the configuration around for creating the per-worker contexts */
+	ctx->pool = cfg->pool;
+	ctx->cfg = *cfg;
+	ctx->cfg.pairs = ctx->pairs;
+	ctx->cfg.n_pairs = n_pairs;
+	ctx->cfg.pool = NULL;
+	if (cfg->max_lag != NULL) {
+		ctx->cfg_max_lag = malloc(n_pairs * sizeof(ctx->cfg_max_lag[0]));
+		if (ctx->cfg_max_lag == NULL) {
+			goto fail;
+		}
+		memcpy(ctx->cfg_max_lag, cfg->max_lag, n_pairs * sizeof(ctx->cfg_max_lag[0]));
+		ctx->cfg.max_lag = ctx->cfg_max_lag;
+	}
+
+	ctx->upres = upres_factor;
+	ctx->samples = cfg->samples;
+	ctx->data_len = n_samples;
+	ctx->out_len = n_samples * upres_factor;
+	if (split_fft(&ctx->fft_f, cfg->n_mics, n_workers) < 0 ||
+	    split_fft(&ctx->fft_r, n_pairs, n_workers) < 0) {
+		goto fail;
+	}
+
+	/* output window, in super-resolved samples */
+	for (int i = 0; i < n_pairs; i++) {
+		int lag = cfg->max_lag == NULL ? n_samples / 2 : cfg->max_lag[i];
+		lag = lag < 0 || lag > n_samples / 2 ? n_samples / 2 : lag;
+		ctx->lag[i] = lag * upres_factor;
+		ctx->lag_max = ctx->lag[i] > ctx->lag_max ? ctx->lag[i] : ctx->lag_max;
+	}
+	ctx->row_len = cfg->max_lag == NULL ? ctx->out_len : ctx->lag_max * 2 + 1;
+
+	/* rough flop counts of a batched c2r FFT vs. the pruned DFT; the DFT
+	 * costs a pass over every bin per lag, so it loses to the FFT for any
+	 * window more than a few samples wide
+	 */
+	double len_r = n_samples * upres_factor * 2, cost_fft = 2.5 * len_r * log2(len_r) * n_pairs;
+	double cost_direct = 0.0;
+	for (int i = 0; i < n_pairs; i++) {
+		cost_direct += 4.0 * (ctx->lag[i] + 1) * (n_samples + 1);
+	}
+	ctx->direct = cfg->max_lag != NULL && cost_direct < cost_fft;
+	ctx->refine = cfg->refine;
+
+	ctx->peak_rows = fftw_alloc_real((size_t)n_pairs * ctx->row_len);
+	if (ctx->peak_rows == NULL) {
+		goto fail;
+	}
+	if (ctx->direct || ctx->refine == LOCATE_REFINE_SINC) {
+		ctx->dir_spec = fftw_alloc_real((size_t)n_pairs * (n_samples + 1) * 2);
+		if (ctx->dir_spec == NULL) {
+			goto fail;
+		}
+	}
+	if (cfg->weight != NULL) {
+		ctx->weight = fftw_alloc_real(n_samples + 1);
+		if (ctx->weight == NULL) {
+			goto fail;
+		}
+		memcpy(ctx->weight, cfg->weight, (n_samples + 1) * sizeof(ctx->weight[0]));
+		ctx->cfg.weight = ctx->weight;
+	}
+
+	pthread_mutex_lock(&planner_lock);
+
+	if (cfg->effort > LOCATE_PLAN_ESTIMATE) {
+		have_path = wisdom_path(ctx, path, sizeof(path)) == 0;
+		have_wisdom = have_path && fftw_import_wisdom_from_filename(path);
+	}
+
+	new_f = init_fft(&ctx->fft_f, n_samples * 2, FFTW_FORWARD, plan_flags[cfg->effort],
+	                 have_wisdom);
+	if (ctx->direct) {
+		ctx->fft_r.len = (int)len_r;
+		if (parent != NULL) {
+			ctx->dir_tab = parent->dir_tab;
+		} else {
+			new_r = init_direct(ctx);
+		}
+	} else {
+		new_r = init_fft(&ctx->fft_r, (int)len_r, FFTW_BACKWARD, plan_flags[cfg->effort],
+		                 have_wisdom);
+	}
+
+	/* write to a temporary file first so concurrent runs never see a
+	 * partial cache
+	 */
+	if (new_f >= 0 && new_r >= 0 && have_path && (new_f || new_r)) {
+		char tmp[sizeof(path) + 32];
+		snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+		if (!fftw_export_wisdom_to_filename(tmp) || rename(tmp, path) < 0) {
+			fprintf(stderr, "warning: %s: could not save FFT wisdom\n", path);
+			unlink(tmp);
+		}
+	}
+
+	pthread_mutex_unlock(&planner_lock);
+
+	if (new_f < 0 || new_r < 0) {
+		goto fail;
+	}
+	return ctx;
+
+fail:
+	locate_ctx_destroy(ctx);
+	return NULL;
+}
+
+/** @brief Creates the per-worker contexts used by `locate_ctx_xcor_frames`
+ *  @param ctx Context to create them for
  *  @return 0 on success, negative on failure
  *
- *  Initializes `locate_xcor` to compute the cross-correlation of `n_mics`
- *  input signals using `n_samples` samples from each one.
+ *  Each is a copy of `ctx` without a pool, sharing its plans and tables.
  */
-int locate_init(int n_samples, int n_mics, int upres_factor)
+static int init_lanes(locate_ctx_t *ctx)
 {
-	fft_count = n_mics;
-	fft_upres = upres_factor;
-	fft_data_len = n_samples;
-	fft_out_len = n_samples * upres_factor;
+	int n = pool_size(ctx->pool);
 
-	if (init_fft(&fft_f, n_samples * 2, FFTW_FORWARD) < 0 ||
-	    init_fft(&fft_r, n_samples * upres_factor * 2, FFTW_BACKWARD) < 0) {
+	if (ctx->lanes != NULL) {
+		return 0;
+	}
+
+	ctx->lanes = calloc(n, sizeof(ctx->lanes[0]));
+	if (ctx->lanes == NULL) {
 		return -1;
 	}
 
+	for (int i = 0; i < n; i++) {
+		if ((ctx->lanes[i] = ctx_create(&ctx->cfg, ctx)) == NULL) {
+			for (int j = 0; j < i; j++) {
+				locate_ctx_destroy(ctx->lanes[j]);
+			}
+			free(ctx->lanes);
+			ctx->lanes = NULL;
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
+/** @brief Frees a locate context
+ *  @param ctx Context to free, may be NULL
+ */
+void locate_ctx_destroy(locate_ctx_t *ctx)
+{
+	if (ctx == NULL) {
+		return;
+	}
+
+	if (ctx->lanes != NULL) {
+		for (int i = 0; i < pool_size(ctx->pool); i++) {
+			locate_ctx_destroy(ctx->lanes[i]);
+		}
+		free(ctx->lanes);
+	}
+
+	pthread_mutex_lock(&planner_lock);
+	free_fft(&ctx->fft_f);
+	free_fft(&ctx->fft_r);
+	pthread_mutex_unlock(&planner_lock);
+
+	if (ctx->own_tables) {
+		fftw_free(ctx->dir_tab);
+	}
+	fftw_free(ctx->dir_spec);
+	fftw_free(ctx->weight);
+	fftw_free(ctx->peak_rows);
+	free(ctx->pairs);
+	free(ctx->lag);
+	free(ctx->cfg_max_lag);
+	free(ctx);
+}
+
+/** @brief Gets the length of each row of `locate_ctx_xcor` output
+ *  @param ctx Context to query
+ *  @return Row length; lag 0 is at index row length / 2
+ */
+int locate_ctx_row_len(const locate_ctx_t *ctx)
+{
+	return ctx->row_len;
+}
+
+/** @brief Converts 16-bit samples to floating point, scaled to +/-1
+ *  @param src Samples to convert
+ *  @param n Number of samples
+ *  @param dst Output; converted samples
+ *
+ *  Gives the same values as converting when the file is read, so results
+ *  don't depend on how the inputs are stored.
+ */
+static void gather_i16(const int16_t *src, int n, real_t *dst)
+{
+	const real_t scale = 1.0 / (real_t)((size_t)INT16_MAX + 1);
+	int i = 0;
+
+#if defined(__SSE2__) && !defined(USE_DOUBLE)
+	const __m128 vscale = _mm_set1_ps(scale);
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+
+		/* sign-extend by unpacking into the high halves and shifting down */
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+	}
+#endif
+	for (; i < n; i++) {
+		dst[i] = (real_t)src[i] * scale;
+	}
+}
+
+/** @brief Gathers and transforms one chunk of the inputs
+ *  @param arg `struct xcor_job`
+ *  @param chunk Chunk of `fft_f` to transform
+ *  @param worker Unused
+ */
+static void forward_job(void *arg, int chunk, int worker)
+{
+	struct xcor_job *job = arg;
+	struct fft *fft = &job->ctx->fft_f;
+	int m0 = fft->chunk[chunk], m1 = fft->chunk[chunk + 1];
+
+	/* gather input data - second half of each input stays zero */
+	for (int i = m0; i < m1; i++) {
+		real_t *dst = fft->real + (size_t)fft->real_dist * i;
+
+		if (job->ctx->samples == LOCATE_SAMPLES_INT16) {
+			const int16_t *const *src = job->data;
+			gather_i16(src[i] + job->data_offset, job->ctx->data_len, dst);
+		} else {
+			real_t *const *src = job->data;
+			memcpy(dst, src[i] + job->data_offset, job->ctx->data_len * sizeof(real_t));
+		}
+	}
+
+	fftw_execute_dft_r2c(fft->chunk_plan[chunk]->plan, fft->real + (size_t)fft->real_dist * m0,
+	                     fft->cplx + (size_t)fft->cplx_dist * m0);
+}
+
+/** @brief Correlates one chunk of the mic pairs
+ *  @param arg `struct xcor_job`
+ *  @param chunk Chunk of `fft_r` to correlate
+ *  @param worker Unused
+ *
+ *  Whitens the cross-spectrum of each pair in the chunk, transforms it back
+ *  and copies the lag window to the output, then finds the peaks of the
+ *  chunk if they were asked for.
+ */
+static void inverse_job(void *arg, int chunk, int worker)
+{
+	struct xcor_job *job = arg;
+	locate_ctx_t *ctx = job->ctx;
+	struct fft *fft_f = &ctx->fft_f, *fft_r = &ctx->fft_r;
+	int i, j, n_bins = fft_f->len / 2, row_len = ctx->row_len, center = row_len / 2;
+	int p0 = fft_r->chunk[chunk], p1 = fft_r->chunk[chunk + 1];
+	real_t *res = job->res;
+
+	/* multiply the DFT of the first of each pair by the conjugate of the
+	 * DFT of the second, normalized to unit magnitude
+	 */
+	const real_t *spec_f = (const real_t *)fft_f->cplx;
+	size_t spec_dist = (size_t)fft_f->cplx_dist * 2;
+
+	for (i = p0; i < p1; i++) {
+		const real_t *src_a = spec_f + spec_dist * ctx->pairs[i].a;
+		const real_t *src_b = spec_f + spec_dist * ctx->pairs[i].b;
+
+		if (ctx->direct) {
+			whiten(src_a, src_b, ctx->weight, n_bins + 1,
+			       ctx->dir_spec + (size_t)fft_f->cplx_len * 2 * i);
+			continue;
+		}
+
+		fftw_complex *dst = fft_r->cplx + (size_t)fft_r->cplx_dist * i;
+
+		/* to achieve super-resolution, expand FFT as band-limited FFT
+		 * before reversing - only the positive half is stored, so this
+		 * just means zeroing everything past the original Nyquist bin
+		 */
+		whiten(src_a, src_b, ctx->weight, n_bins + 1, (real_t *)dst);
+
+		/* c2r is about to destroy the spectrum, keep it if peaks are to
+		 * be refined from it
+		 */
+		if (job->peaks != NULL && ctx->refine == LOCATE_REFINE_SINC) {
+			memcpy(ctx->dir_spec + (size_t)fft_f->cplx_len * 2 * i, dst,
+			       (n_bins + 1) * sizeof(*dst));
+		}
+
+		/* the original Nyquist bin is split between +/- frequencies when
+		 * expanded; c2r implicitly supplies the conjugate half
+		 */
+		if (ctx->upres > 1) {
+			dst[n_bins] *= 0.5;
+		}
+
+		/* c2r destroys its input, so the padding has to be redone */
+		memset(dst + n_bins + 1, 0, (fft_r->cplx_len - n_bins - 1) * sizeof(*dst));
+	}
+
+	/* copy (shifted) to result, scaling to remove partial overlap bias */
+	real_t scale = ctx->upres * 0.5;
+
+	if (ctx->direct) {
+		for (i = p0; i < p1; i++) {
+			real_t *dst = res + (size_t)row_len * i + center;
+			const real_t *spec = ctx->dir_spec + (size_t)fft_f->cplx_len * 2 * i;
+			int n = fft_f->cplx_len * 2;
+
+			memset(res + (size_t)row_len * i, 0, row_len * sizeof(*res));
+			for (int l = 0; l <= ctx->lag[i]; l++) {
+				const real_t *t = ctx->dir_tab + (size_t)n * l;
+				real_t acc[16] = { 0.0 }, sum_a = 0.0, sum_b = 0.0;
+
+				/* independent partial sums so this vectorizes - even
+				 * ones are the cosine terms, odd ones the sine terms
+				 */
+				for (j = 0; j + 16 <= n; j += 16) {
+					for (int u = 0; u < 16; u++) {
+						acc[u] += spec[j + u] * t[j + u];
+					}
+				}
+				for (; j < n; j += 2) {
+					sum_a += spec[j] * t[j];
+					sum_b += spec[j + 1] * t[j + 1];
+				}
+				for (int u = 0; u < 16; u += 2) {
+					sum_a += acc[u];
+					sum_b += acc[u + 1];
+				}
+
+				real_t sc = scale / (ctx->out_len - l);
+				dst[l] = (sum_a - sum_b) * sc;
+				dst[-l] = (sum_a + sum_b) * sc;
+			}
+		}
+	} else {
+		fftw_execute_dft_c2r(fft_r->chunk_plan[chunk]->plan,
+		                     fft_r->cplx + (size_t)fft_r->cplx_dist * p0,
+		                     fft_r->real + (size_t)fft_r->real_dist * p0);
+
+		for (i = p0; i < p1; i++) {
+			real_t *dst = res + (size_t)row_len * i + center;
+			real_t *src = fft_r->real + (size_t)fft_r->real_dist * i;
+			int lag = ctx->lag[i], lag_end = row_len - center;
+
+			if (row_len > 2 * lag + 1) {
+				memset(res + (size_t)row_len * i, 0, row_len * sizeof(*res));
+			}
+			for (j = -lag; j <= lag && j < lag_end; j++) {
+				int j_off = (j + fft_r->len) % fft_r->len;
+				dst[j] = src[j_off] * scale / (ctx->out_len - abs(j));
+			}
+		}
+	}
+
+	if (job->peaks != NULL) {
+		for (i = p0; i < p1; i++) {
+			find_peak(ctx, i, &job->peaks[i]);
+		}
+	}
+}
+
 /** @brief Computes phase cross-correlation of multiple arrays
- *  @param data Array of arrays of input data
+ *  @param ctx Context to use
+ *  @param data Array of arrays of input data, real_t or int16_t as set by
+ *              `cfg->samples`
  *  @param data_offset Offset in each data array to start reading data
  *  @param res Result array - two-dimensional array of outputs
  *
- *  Computes the phase cross-correlation between successive arrays of input
- *  data, e.g. for 3 input arrays:
+ *  Computes the phase cross-correlation between each pair of input arrays
+ *  given to `locate_ctx_create`, e.g. for the default pairs and 3 input
+ *  arrays:
  *
  *  res[0] = xcor(data[0], data[1])
  *  res[1] = xcor(data[1], data[2])
  *  res[2] = xcor(data[2], data[0])
  *
+ *  Each input is transformed once no matter how many pairs it is in, and
+ *  the inverse transforms of all pairs are done as one batch per chunk.
+ *
  *  Each row of the result contains the normalized cross-correlation from
  *  offset `-n_samples/2` to offset `n_samples/2`, with index `n_samples/2`
  *  containing the 0-offset cross-correlation. Resolution is increased by
  *  a factor of `upres_factor`, thus `res` is expected to be a
- *  `n_mics * n_samples * upres_factor` array.
+ *  `n_pairs * n_samples * upres_factor` array. If a maximum lag was given,
+ *  rows are instead `locate_ctx_row_len()` long, centered the same way, and
+ *  lags past a pair's maximum are zero.
  */
-void locate_xcor(real_t **data, size_t data_offset, real_t *res)
+void locate_ctx_xcor(locate_ctx_t *ctx, const void *data, size_t data_offset, real_t *res)
 {
-	int i, j;
+	struct xcor_job job = { ctx, data, data_offset, res, NULL };
 
-	/* gather input data */
-	for (i = 0; i < fft_count; i++) {
-		real_t *src = data[i] + data_offset;
-		fftw_complex *dst = fft_f.in + fft_f.len * i;
+	pool_run(ctx->pool, ctx->fft_f.n_chunks, forward_job, &job);
+	pool_run(ctx->pool, ctx->fft_r.n_chunks, inverse_job, &job);
+}
 
-		for (j = 0; j < fft_data_len; j++) {
-			dst[j] = src[j];
-		}
+/** @brief Evaluates a band-limited cross-correlation and its derivatives
+ *  @param ctx Context holding the whitened spectra
+ *  @param pair Index of mic pair
+ *  @param lag Lag to evaluate at, in super-resolved samples
+ *  @param d1 Output; first derivative with respect to lag
+ *  @param d2 Output; second derivative with respect to lag
+ *  @return Cross-correlation at `lag` (before overlap bias correction)
+ *
+ *  Same sum as the pruned inverse DFT (see `init_direct`), but at an
+ *  arbitrary lag. The per-bin rotation is built up by repeated complex
+ *  multiplication in double precision instead of calling cos/sin per bin.
+ */
+static real_t eval_lag(const locate_ctx_t *ctx, int pair, double lag, double *d1, double *d2)
+{
+	int n_bins = ctx->fft_f.cplx_len;
+	const real_t *spec = ctx->dir_spec + (size_t)n_bins * 2 * pair;
+	double phi = 2.0 * M_PI / ctx->fft_r.len;
+	double complex step = cexp(I * phi * lag), z = 1.0;
+	double r = 0.0, r1 = 0.0, r2 = 0.0;
+
+	for (int k = 0; k < n_bins; k++, z *= step) {
+		double w = (k == 0 || k == n_bins - 1) ? 1.0 : 2.0, wk = w * phi * k;
+		double c = creal(z), s = cimag(z), re = spec[2 * k], im = spec[2 * k + 1];
+		r  += w * (re * c - im * s);
+		r1 -= wk * (re * s + im * c);
+		r2 -= wk * phi * k * (re * c - im * s);
 	}
 
-	fftw_execute(fft_f.plan);
+	*d1 = r1;
+	*d2 = r2;
+	return r;
+}
 
-	/* multiply each DFT by the conjugate of the next DFT */
-	for (i = 0; i < fft_count; i++) {
-		fftw_complex *src      = fft_f.out + fft_f.len * i;
-		fftw_complex *src_next = fft_f.out + fft_f.len * ((i + 1) % fft_count);
-		fftw_complex *dst      = fft_r.in  + fft_r.len * i;
+/** @brief Finds and refines the cross-correlation peak of one mic pair
+ *  @param ctx Context with the pair's correlation in `peak_rows`
+ *  @param pair Index of mic pair
+ *  @param peak Output; peak of the pair
+ */
+static void find_peak(const locate_ctx_t *ctx, int pair, locate_peak_t *peak)
+{
+	int center = ctx->row_len / 2, lag_end = ctx->row_len - center;
+	const real_t *row = ctx->peak_rows + (size_t)ctx->row_len * pair + center;
+	int lag = ctx->lag[pair], lo = -lag, hi = lag < lag_end ? lag : lag_end - 1, best = lo;
+	real_t scale = ctx->upres * 0.5;
 
-		/* to achieve super-resolution, expand FFT as band-limited FFT
-		 * before reversing - first half goes at the beginning
-		 */
-		for (j = 0; j < fft_f.len / 2; j++) {
-			dst[j] = src[j] * conj(src_next[j]);
-			dst[j] /= cabs(dst[j]);
-		}
+	for (int j = lo + 1; j <= hi; j++) {
+		best = row[j] > row[best] ? j : best;
+	}
 
-		/* second half goes at the end */
-		dst += fft_r.len - fft_f.len;
-		for (; j < fft_f.len; j++) {
-			dst[j] = src[j] * conj(src_next[j]);
-			dst[j] /= cabs(dst[j]);
+	double pos = best, val = row[best];
+	if (ctx->refine == LOCATE_REFINE_PARABOLIC && best > lo && best < hi) {
+		double y0 = row[best - 1], y1 = row[best], y2 = row[best + 1];
+		double den = y0 - 2.0 * y1 + y2;
+		if (den < 0.0) {
+			double delta = 0.5 * (y0 - y2) / den;
+			pos = best + delta;
+			val = y1 - 0.25 * (y0 - y2) * delta;
 		}
+	} else if (ctx->refine == LOCATE_REFINE_SINC) {
+		double d1, d2;
+		for (int n = 0; n < 4; n++) {
+			eval_lag(ctx, pair, pos, &d1, &d2);
+			if (d2 >= 0.0) {
+				break;
+			}
+			double next = pos - d1 / d2;
+			pos = next < best - 1.0 ? best - 1.0 : next > best + 1.0 ? best + 1.0 : next;
+		}
+		val = eval_lag(ctx, pair, pos, &d1, &d2) * scale / (ctx->out_len - fabs(pos));
 	}
 
-	fftw_execute(fft_r.plan);
+	peak->lag = pos / ctx->upres;
+	peak->value = val;
+}
 
-	/* copy (shifted) to result, scaling to remove partial overlap bias */
-	real_t scale = fft_upres * 0.5;
-	for (i = 0; i < fft_count; i++) {
-		real_t *dst = res + fft_out_len * i;
-		fftw_complex *src = fft_r.out + fft_r.len * i;
+/** @brief Computes the cross-correlation peak of each mic pair
+ *  @param ctx Context to use
+ *  @param data Array of arrays of input data, real_t or int16_t as set by
+ *              `cfg->samples`
+ *  @param data_offset Offset in each data array to start reading data
+ *  @param peaks Output; one peak per mic pair
+ *
+ *  Runs `locate_ctx_xcor`, finds the maximum of each row within that pair's
+ *  lag window, and refines it to a fractional lag according to the `refine`
+ *  setting the context was created with:
+ *
+ *  LOCATE_REFINE_NONE: no refinement
+ *  LOCATE_REFINE_PARABOLIC: vertex of a parabola through the maximum and
+ *    its neighbours
+ *  LOCATE_REFINE_SINC: a few Newton steps on the exact band-limited
+ *    interpolation of the correlation, i.e. sinc interpolation, evaluated
+ *    directly from the whitened spectrum
+ *
+ *  With refinement, super-resolution is rarely worth it; use an `upres` of
+ *  1 so the inverse transforms are at native length.
+ */
+void locate_ctx_peaks(locate_ctx_t *ctx, const void *data, size_t data_offset,
+                      locate_peak_t *peaks)
+{
+	struct xcor_job job = { ctx, data, data_offset, ctx->peak_rows, peaks };
 
-		for (j = 0; j < fft_out_len; j++) {
-			int d = abs((int)j - fft_out_len / 2);
-			int j_off = (j + fft_r.len - fft_out_len / 2) % fft_r.len;
-			dst[j] = src[j_off] * scale / (fft_out_len - d);
-		}
+	pool_run(ctx->pool, ctx->fft_f.n_chunks, forward_job, &job);
+	pool_run(ctx->pool, ctx->fft_r.n_chunks, inverse_job, &job);
+}
+
+/** @brief Correlates one frame of a batch
+ *  @param arg `struct frames_job`
+ *  @param frame Frame number within the batch
+ *  @param worker Worker running the job; picks the context to use
+ */
+static void frame_job(void *arg, int frame, int worker)
+{
+	struct frames_job *job = arg;
+	locate_ctx_t *ctx = job->ctx, *lane = ctx->lanes != NULL ? ctx->lanes[worker] : ctx;
+	int n_pairs = ctx->fft_r.count;
+
+	if (job->peaks != NULL) {
+		locate_ctx_peaks(lane, job->data, job->offsets[frame],
+		                 job->peaks + (size_t)n_pairs * frame);
+	} else {
+		locate_ctx_xcor(lane, job->data, job->offsets[frame],
+		                job->res + (size_t)n_pairs * ctx->row_len * frame);
 	}
 }
+
+/** @brief Runs a batch of frames, one per worker at a time
+ *  @param job Batch to run
+ *  @param n_frames Number of frames in batch
+ *
+ *  If the per-worker contexts can't be created, frames are run one after
+ *  another, each split among the workers instead.
+ */
+static void run_frames(struct frames_job *job, int n_frames)
+{
+	locate_ctx_t *ctx = job->ctx;
+
+	if (pool_size(ctx->pool) > 1 && init_lanes(ctx) == 0) {
+		pool_run(ctx->pool, n_frames, frame_job, job);
+	} else {
+		pool_run(NULL, n_frames, frame_job, job);
+	}
+}
+
+/** @brief Computes phase cross-correlation of several frames at once
+ *  @param ctx Context to use
+ *  @param data Array of arrays of input data, real_t or int16_t as set by
+ *              `cfg->samples`
+ *  @param offsets Offset in each data array of each frame
+ *  @param n_frames Number of frames
+ *  @param res Result array - `n_frames` consecutive `locate_ctx_xcor` results
+ *
+ *  Same as calling `locate_ctx_xcor` for each frame in turn, but with a pool
+ *  the frames are spread over the workers, each with a whole frame to
+ *  itself. This scales better than splitting single frames when there are
+ *  few mics or pairs. Results are always stored in frame order.
+ */
+void locate_ctx_xcor_frames(locate_ctx_t *ctx, const void *data, const size_t *offsets,
+                            int n_frames, real_t *res)
+{
+	struct frames_job job = { ctx, data, offsets, res, NULL };
+	run_frames(&job, n_frames);
+}
+
+/** @brief Computes cross-correlation peaks of several frames at once
+ *  @param ctx Context to use
+ *  @param data Array of arrays of input data, real_t or int16_t as set by
+ *              `cfg->samples`
+ *  @param offsets Offset in each data array of each frame
+ *  @param n_frames Number of frames
+ *  @param peaks Output; `n_frames` consecutive `locate_ctx_peaks` results
+ *
+ *  See `locate_ctx_xcor_frames`.
+ */
+void locate_ctx_peaks_frames(locate_ctx_t *ctx, const void *data, const size_t *offsets,
+                             int n_frames, locate_peak_t *peaks)
+{
+	struct frames_job job = { ctx, data, offsets, NULL, peaks };
+	run_frames(&job, n_frames);
+}
+
+/** @brief Initializes locate
+ *  @param cfg Configuration - see `locate_cfg_t`
+ *  @return 0 on success, negative on failure
+ *
+ *  Sets up the default context used by `locate_xcor`, `locate_peaks` and
+ *  `locate_row_len`, for programs that only process one array. Calling it
+ *  again replaces the default context.
+ */
+int locate_init(const locate_cfg_t *cfg)
+{
+	locate_ctx_destroy(default_ctx);
+	default_ctx = locate_ctx_create(cfg);
+	return default_ctx == NULL ? -1 : 0;
+}
+
+/** @brief Gets the length of each row of `locate_xcor` output
+ *  @return Row length; lag 0 is at index row length / 2
+ */
+int locate_row_len(void)
+{
+	return locate_ctx_row_len(default_ctx);
+}
+
+/** @brief `locate_ctx_xcor` on the default context */
+void locate_xcor(const void *data, size_t data_offset, real_t *res)
+{
+	locate_ctx_xcor(default_ctx, data, data_offset, res);
+}
+
+/** @brief `locate_ctx_peaks` on the default context */
+void locate_peaks(const void *data, size_t data_offset, locate_peak_t *peaks)
+{
+	locate_ctx_peaks(default_ctx, data, data_offset, peaks);
+}
+
+/** @brief `locate_ctx_xcor_frames` on the default context */
+void locate_xcor_frames(const void *data, const size_t *offsets, int n_frames,
+                        real_t *res)
+{
+	locate_ctx_xcor_frames(default_ctx, data, offsets, n_frames, res);
+}
+
+/** @brief `locate_ctx_peaks_frames` on the default context */
+void locate_peaks_frames(const void *data, const size_t *offsets, int n_frames,
+                         locate_peak_t *peaks)
+{
+	locate_ctx_peaks_frames(default_ctx, data, offsets, n_frames, peaks);
+}
@@ -1,7 +1,78 @@
 #ifndef _LOCATE_H_
 #define _LOCATE_H_
 
-int locate_init(int n_samples, int n_mics, int upres_factor);
-void locate_xcor(real_t **data, size_t offset, real_t *res);
+#include "pool.h"
+#include "vector.h"
+
+/* FFT planning effort - more effort means slower startup, faster FFTs */
+enum {
+	LOCATE_PLAN_ESTIMATE = 0,
+	LOCATE_PLAN_MEASURE,
+	LOCATE_PLAN_PATIENT,
+};
+
+/* fractional-lag refinement for `locate_peaks` */
+enum {
+	LOCATE_REFINE_NONE = 0,
+	LOCATE_REFINE_PARABOLIC,
+	LOCATE_REFINE_SINC,
+};
+
+/* how the input samples are stored */
+enum {
+	LOCATE_SAMPLES_REAL = 0, /* real_t */
+	LOCATE_SAMPLES_INT16,    /* int16_t, full scale converted to +/-1 while gathering */
+};
+
+typedef struct {
+	int a, b; /* mic indices */
+} locate_pair_t;
+
+typedef struct {
+	real_t lag;   /* lag of maximum in samples, positive if sound reaches b first */
+	real_t value; /* cross-correlation at that lag */
+} locate_peak_t;
+
+typedef struct {
+	int n_samples;              /* samples taken from each input per frame */
+	int n_mics;                 /* number of inputs */
+	int upres;                  /* super-resolution factor */
+	const locate_pair_t *pairs; /* pairs to correlate, or NULL for each mic and the next */
+	int n_pairs;
+	const int *max_lag;         /* per-pair maximum lag in samples, or NULL for all lags */
+	int effort;                 /* FFT planning effort, one of LOCATE_PLAN_* */
+	int refine;                 /* peak refinement, one of LOCATE_REFINE_* */
+	pool_t *pool;               /* workers to split frames among, or NULL */
+	const real_t *weight;       /* weight of each of the n_samples + 1 frequency bins
+	                               after whitening, or NULL for none */
+	int samples;                /* input sample format, one of LOCATE_SAMPLES_* */
+} locate_cfg_t;
+
+/* independent cross-correlation state for one array - see `locate_ctx_create` */
+typedef struct locate_ctx locate_ctx_t;
+
+locate_pair_t *locate_pairs(const char *spec, int n_mics, int *n_pairs_out);
+int *locate_max_lags(const vec3_t *mic_pos, const real_t *mic_delay,
+                     const locate_pair_t *pairs, int n_pairs, real_t sample_rate);
+locate_ctx_t *locate_ctx_create(const locate_cfg_t *cfg);
+void locate_ctx_destroy(locate_ctx_t *ctx);
+int locate_ctx_row_len(const locate_ctx_t *ctx);
+void locate_ctx_xcor(locate_ctx_t *ctx, const void *data, size_t offset, real_t *res);
+void locate_ctx_peaks(locate_ctx_t *ctx, const void *data, size_t offset,
+                      locate_peak_t *peaks);
+void locate_ctx_xcor_frames(locate_ctx_t *ctx, const void *data, const size_t *offsets,
+                            int n_frames, real_t *res);
+void locate_ctx_peaks_frames(locate_ctx_t *ctx, const void *data, const size_t *offsets,
+                             int n_frames, locate_peak_t *peaks);
+
+/* single default context, for programs that only process one array */
+int locate_init(const locate_cfg_t *cfg);
+int locate_row_len(void);
+void locate_xcor(const void *data, size_t offset, real_t *res);
+void locate_peaks(const void *data, size_t offset, locate_peak_t *peaks);
+void locate_xcor_frames(const void *data, const size_t *offsets, int n_frames,
+                        real_t *res);
+void locate_peaks_frames(const void *data, const size_t *offsets, int n_frames,
+                         locate_peak_t *peaks);
 
 #endif /* _LOCATE_H_ */
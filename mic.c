@@ -1,38 +0,0 @@
-#define RSQRT_3 0.57735026918962576451
-#define SQRT_3 1.73205080756887729353
-/* 12-pos (clockwise from top):
-	{ .x =  0.0     , .y =  0.5       , .z = 0.0 },
-	{ .x =  0.25    , .y =  SQRT_3/4.0, .z = 0.0 },
-	{ .x =  SQRT_3/4, .y =  0.25      , .z = 0.0 },
-	{ .x =  0.5     , .y = -0.0       , .z = 0.0 },
-	{ .x =  SQRT_3/4, .y = -0.25      , .z = 0.0 },
-	{ .x =  0.25    , .y = -SQRT_3/4.0, .z = 0.0 },
-	{ .x = -0.0     , .y = -0.5       , .z = 0.0 },
-	{ .x = -0.25    , .y = -SQRT_3/4.0, .z = 0.0 },
-	{ .x = -SQRT_3/4, .y = -0.25      , .z = 0.0 },
-	{ .x = -0.5     , .y =  0.0       , .z = 0.0 },
-	{ .x = -SQRT_3/4, .y =  0.25      , .z = 0.0 },
-	{ .x = -0.25    , .y =  SQRT_3/4.0, .z = 0.0 },
- */
-static vec3_t mic_pos[] = {
-#if 0
-	{ .x = -0.5, .y = -RSQRT_3/2.0, .z = 0.0 },
-	{ .x =  0.5, .y = -RSQRT_3/2.0, .z = 0.0 },
-	{ .x =  0.0, .y =  RSQRT_3/1.0, .z = 0.0 },
-#else
-	/* 12/5 star */
-	{ .x =  0.0     , .y =  0.5       , .z = 0.0 },
-	{ .x =  0.25    , .y = -SQRT_3/4.0, .z = 0.0 },
-	{ .x = -SQRT_3/4, .y =  0.25      , .z = 0.0 },
-	{ .x =  0.5     , .y = -0.0       , .z = 0.0 },
-	{ .x = -SQRT_3/4, .y = -0.25      , .z = 0.0 },
-	{ .x =  0.25    , .y =  SQRT_3/4.0, .z = 0.0 },
-	{ .x = -0.0     , .y = -0.5       , .z = 0.0 },
-	{ .x = -0.25    , .y =  SQRT_3/4.0, .z = 0.0 },
-	{ .x =  SQRT_3/4, .y = -0.25      , .z = 0.0 },
-	{ .x = -0.5     , .y =  0.0       , .z = 0.0 },
-	{ .x =  SQRT_3/4, .y =  0.25      , .z = 0.0 },
-	{ .x = -0.25    , .y = -SQRT_3/4.0, .z = 0.0 },
-#endif
-};
-#define N_MICS (sizeof(mic_pos)/sizeof(mic_pos[0]))
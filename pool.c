@@ -0,0 +1,217 @@
+/** @file pool.c
+ *  @brief Fixed-size worker thread pool
+ *
+ *  Runs batches of independent jobs on a set of persistent threads. The
+ *  calling thread takes part as worker 0, so a pool of one worker starts no
+ *  threads at all. Jobs are handed out in order from a shared counter; which
+ *  worker runs which job isn't fixed, so jobs must write their results to
+ *  places determined by the job number alone.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+struct pool {
+	int n_workers;
+	pthread_t *threads;
+
+	/* serializes `pool_run` callers sharing the pool */
+	pthread_mutex_t run_lock;
+
+	/* protects everything below */
+	pthread_mutex_t lock;
+	pthread_cond_t wake, idle;
+	unsigned batch; /* incremented for each new batch of jobs */
+	int busy;       /* threads still working on the current batch */
+	int quit;
+
+	pool_fn_t fn;
+	void *arg;
+	int n_jobs;
+	atomic_int next;
+};
+
+struct worker_arg {
+	pool_t *pool;
+	int id;
+};
+
+/** @brief Runs jobs of the current batch until there are none left
+ *  @param pool Pool to take jobs from
+ *  @param id Worker number
+ */
+static void run_jobs(pool_t *pool, int id)
+{
+	int job;
+
+	while ((job = atomic_fetch_add(&pool->next, 1)) < pool->n_jobs) {
+		pool->fn(pool->arg, job, id);
+	}
+}
+
+static void *pool_thread(void *arg_v)
+{
+	struct worker_arg *arg = arg_v;
+	pool_t *pool = arg->pool;
+	int id = arg->id;
+	unsigned seen = 0;
+
+	free(arg);
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->batch == seen && !pool->quit) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		if (pool->quit) {
+			break;
+		}
+		seen = pool->batch;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_jobs(pool, id);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0) {
+			pthread_cond_signal(&pool->idle);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/** @brief Creates a thread pool
+ *  @param n_workers Number of workers, including the thread calling
+ *                   `pool_run`; less than 1 means one per online CPU
+ *  @return New pool, or NULL on failure
+ */
+pool_t *pool_create(int n_workers)
+{
+	pool_t *pool;
+
+	if (n_workers < 1) {
+#ifdef _SC_NPROCESSORS_ONLN
+		n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+		n_workers = 2;
+#endif
+		n_workers = n_workers < 1 ? 1 : n_workers;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->threads = calloc(n_workers, sizeof(pool->threads[0]));
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	atomic_init(&pool->next, 0);
+
+	/* worker 0 is whoever calls `pool_run` */
+	pool->n_workers = 1;
+	for (int i = 1; i < n_workers; i++) {
+		struct worker_arg *arg = malloc(sizeof(*arg));
+		if (arg == NULL) {
+			break;
+		}
+		arg->pool = pool;
+		arg->id = i;
+		if (pthread_create(&pool->threads[i], NULL, pool_thread, arg) != 0) {
+			free(arg);
+			break;
+		}
+		pool->n_workers++;
+	}
+
+	return pool;
+}
+
+/** @brief Stops the threads of a pool and frees it
+ *  @param pool Pool to destroy, may be NULL
+ *
+ *  Must not be called while a batch is running.
+ */
+void pool_destroy(pool_t *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 1; i < pool->n_workers; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->run_lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/** @brief Gets the number of workers in a pool
+ *  @param pool Pool to query, may be NULL
+ *  @return Number of workers; 1 for a NULL pool
+ */
+int pool_size(const pool_t *pool)
+{
+	return pool == NULL ? 1 : pool->n_workers;
+}
+
+/** @brief Runs a batch of jobs and waits for all of them to finish
+ *  @param pool Pool to run jobs on; NULL runs them on the calling thread
+ *  @param n_jobs Number of jobs
+ *  @param fn Function to call for each job, with job numbers 0 to n_jobs-1
+ *  @param arg Argument to pass to `fn`
+ *
+ *  Jobs may be run in any order and on any worker. Several threads may
+ *  share a pool; their batches are run one after another.
+ */
+void pool_run(pool_t *pool, int n_jobs, pool_fn_t fn, void *arg)
+{
+	if (pool == NULL || pool->n_workers == 1 || n_jobs <= 1) {
+		for (int i = 0; i < n_jobs; i++) {
+			fn(arg, i, 0);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&pool->run_lock);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->n_jobs = n_jobs;
+	atomic_store(&pool->next, 0);
+	pool->busy = pool->n_workers - 1;
+	pool->batch++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	run_jobs(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy > 0) {
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_unlock(&pool->run_lock);
+}
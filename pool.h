@@ -0,0 +1,16 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/* job callback - `worker` is in [0, pool_size()) and unique among jobs running
+ * at the same time, so it can index per-worker scratch space
+ */
+typedef void (*pool_fn_t)(void *arg, int job, int worker);
+
+typedef struct pool pool_t;
+
+pool_t *pool_create(int n_workers);
+void pool_destroy(pool_t *pool);
+int pool_size(const pool_t *pool);
+void pool_run(pool_t *pool, int n_jobs, pool_fn_t fn, void *arg);
+
+#endif /* _POOL_H_ */
@@ -0,0 +1,23 @@
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stddef.h>
+
+#include "globals.h"
+
+#define RESAMPLE_HALF_DEFAULT 31    /* taps on each side of the sample point */
+#define RESAMPLE_PHASES_DEFAULT 512 /* fractional delays in the table */
+
+/* polyphase windowed-sinc fractional delay filter bank */
+typedef struct {
+	int half;      /* taps on each side of the sample point */
+	int taps;      /* taps per phase, 2 * half rounded up to a multiple of 4 */
+	int phases;    /* delay resolution is 1 / phases samples */
+	real_t *table; /* phases + 1 rows of `taps` weights */
+} resampler_t;
+
+int resampler_init(resampler_t *r, int half, int phases);
+void resampler_free(resampler_t *r);
+real_t resample(const resampler_t *r, const real_t *data, size_t len, size_t base, real_t ds);
+
+#endif /* _RESAMPLE_H_ */
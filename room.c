@@ -0,0 +1,158 @@
+/** @file room.c
+ *  @brief Image-source model of a shoebox room
+ *
+ *  Each reflection off the walls of a rectangular room sounds like it comes
+ *  from the source mirrored in those walls. Along each axis the mirrored
+ *  coordinates are (1 - 2u) s + 2 l L for u in {0, 1} and any integer l,
+ *  with |l - u| + |l| reflections (Allen & Berkley), so the images form a
+ *  lattice that's easy to walk out to a given path length.
+ *
+ *  Only reflections go into the impulse response; the direct path is left to
+ *  `gen`'s delay engines, which follow the source continuously.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "room.h"
+
+#define MAX_ORDER 256
+
+/* image coordinates along one axis, relative to the mic */
+struct axis {
+	int n;
+	double *delta;
+	int *order;
+};
+
+/** @brief Lists the images along one axis that can be within a distance
+ *  @param a Output; its arrays must be freed by the caller, even on failure
+ *  @param s Source coordinate, from the room's lower wall
+ *  @param m Mic coordinate, from the room's lower wall
+ *  @param len Room length along the axis
+ *  @param max_dist Longest path wanted
+ *  @return 0 on success, negative on failure
+ */
+static int axis_images(struct axis *a, double s, double m, double len, double max_dist)
+{
+	int n_l = (int)ceil((max_dist + len) / (2 * len));
+
+	a->n = 0;
+	a->delta = malloc((2 * n_l + 1) * 2 * sizeof(a->delta[0]));
+	a->order = malloc((2 * n_l + 1) * 2 * sizeof(a->order[0]));
+	if (a->delta == NULL || a->order == NULL) {
+		return -1;
+	}
+
+	for (int l = -n_l; l <= n_l; l++) {
+		for (int u = 0; u <= 1; u++) {
+			double d = (1 - 2 * u) * s + 2 * l * len - m;
+			int order = abs(l - u) + abs(l);
+			if (fabs(d) <= max_dist && order <= MAX_ORDER) {
+				a->delta[a->n] = d;
+				a->order[a->n] = order;
+				a->n++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/** @brief Adds a delayed impulse to a filter
+ *  @param r Filter bank for the fractional part of the delay
+ *  @param delay Delay, in samples
+ *  @param gain Gain
+ *  @param h Filter
+ *  @param len Length of filter
+ *
+ *  Delaying by `delay` is reading the input at -`delay`, so this is
+ *  `resample`'s dot product turned around.
+ */
+static void add_impulse(const resampler_t *r, double delay, real_t gain, real_t *h, size_t len)
+{
+	double ds = -delay;
+	ptrdiff_t dsi = (ptrdiff_t)ds - ((ptrdiff_t)ds > ds); /* floor, in double */
+	int p = (int)((ds - dsi) * r->phases + 0.5);
+	const real_t *row = r->table + (size_t)p * r->taps;
+	ptrdiff_t last = -dsi + (r->half - 1);
+
+	for (int j = 0; j < r->taps; j++) {
+		ptrdiff_t n = last - j;
+		if (n >= 0 && n < (ptrdiff_t)len) {
+			h[n] += gain * row[j];
+		}
+	}
+}
+
+/** @brief Computes the reflections from a source to a mic
+ *  @param room Room
+ *  @param src Source position
+ *  @param mic Mic position
+ *  @param rate Sample rate, in Hz
+ *  @param r Filter bank for fractional delays
+ *  @param pre Extra delay added to everything, in samples; has to cover the
+ *             mic's distance from the origin plus the filter length for the
+ *             response to be causal
+ *  @param h Output; impulse response
+ *  @param len Length of impulse response
+ *  @return Number of images in the response, or negative on failure
+ *
+ *  Like the direct path in `gen`, delays are relative to the source's sound
+ *  reaching the origin, and gains are relative to it too: an image at
+ *  distance d is heard at d0 / d, for the source at distance d0.
+ */
+int room_rir(const room_t *room, vec3_t src, vec3_t mic, real_t rate, const resampler_t *r,
+             real_t pre, real_t *h, size_t len)
+{
+	double d0 = vec3_dist(src, vec3_zero);
+	double max_dist = d0 + ((double)len - pre + r->half) / rate * SND_SPEED;
+	double gain[3 * MAX_ORDER + 1];
+	struct axis ax = { 0 }, ay = { 0 }, az = { 0 };
+	int n_images = -1;
+
+	memset(h, 0, len * sizeof(h[0]));
+
+	gain[0] = 1.0;
+	for (int i = 1; i <= 3 * MAX_ORDER; i++) {
+		gain[i] = gain[i - 1] * room->beta;
+	}
+
+	if (axis_images(&ax, src.x + room->size.x / 2, mic.x + room->size.x / 2, room->size.x, max_dist) < 0 ||
+	    axis_images(&ay, src.y + room->size.y / 2, mic.y + room->size.y / 2, room->size.y, max_dist) < 0 ||
+	    axis_images(&az, src.z + room->size.z / 2, mic.z + room->size.z / 2, room->size.z, max_dist) < 0) {
+		goto fail;
+	}
+
+	n_images = 0;
+	for (int i = 0; i < ax.n; i++) {
+		double dx2 = ax.delta[i] * ax.delta[i];
+		for (int j = 0; j < ay.n; j++) {
+			double dxy2 = dx2 + ay.delta[j] * ay.delta[j];
+			if (dxy2 > max_dist * max_dist) {
+				continue;
+			}
+			for (int k = 0; k < az.n; k++) {
+				int order = ax.order[i] + ay.order[j] + az.order[k];
+				double d = sqrt(dxy2 + az.delta[k] * az.delta[k]);
+
+				if (order == 0 || d > max_dist) {
+					continue; /* direct path, or too late */
+				}
+				add_impulse(r, (d - d0) / SND_SPEED * rate + pre, gain[order] * d0 / d, h, len);
+				n_images++;
+			}
+		}
+	}
+
+fail:
+	free(ax.delta);
+	free(ax.order);
+	free(ay.delta);
+	free(ay.order);
+	free(az.delta);
+	free(az.order);
+
+	return n_images;
+}
@@ -0,0 +1,19 @@
+#ifndef _ROOM_H_
+#define _ROOM_H_
+
+#include <stddef.h>
+
+#include "globals.h"
+#include "resample.h"
+#include "vector.h"
+
+/* shoebox room, centred on the origin */
+typedef struct {
+	vec3_t size; /* m */
+	real_t beta; /* wall reflection coefficient */
+} room_t;
+
+int room_rir(const room_t *room, vec3_t src, vec3_t mic, real_t rate, const resampler_t *r,
+             real_t pre, real_t *h, size_t len);
+
+#endif /* _ROOM_H_ */
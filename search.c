@@ -0,0 +1,501 @@
+/** @file search.c
+ *  @brief Coarse-to-fine search for sources
+ *
+ *  Finds the peaks `field_peaks` would find in the full field, without
+ *  evaluating most of it. The grid is cut into boxes a few cells across, and
+ *  each box gets an upper bound on the score of any cell in it: the sum over
+ *  pairs of the largest cross-correlation at any lag a point in the box can
+ *  have. The best boxes are kept, and refined best first: the box with the
+ *  highest bound is split in half along each axis (a quadtree in the plane,
+ *  an octree in a volume) and its children bounded in turn, until a single
+ *  cell, scored exactly, comes out on top. That cell beats everything left,
+ *  so it's the next peak.
+ *
+ *  Only boxes whose bound beats the peaks are ever split, so the work goes
+ *  with the number of sources rather than the size of the grid. Within the
+ *  boxes kept the peaks are the same as `field_peaks`; a source whose box
+ *  didn't make the cut is missed, which takes a lot of louder clutter.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+
+#define SEARCH_BLOCK 16 /* samples per block of `block_max` */
+
+/** @brief Sets up a search
+ *  @param s Search to initialize
+ *  @param res Grid size in x, y and z, in cells; zres 1 for the z = 0 plane
+ *  @param size Grid extent in x, y and z, in meters; depth 0 for the plane
+ *  @param coarse_size Largest box searched first, in meters
+ *  @param beam Coarse boxes refined, per peak sought
+ *  @param array Mic positions and channel delays
+ *  @param pairs Mic pair of each cross-correlation row
+ *  @param n_pairs Number of mic pairs
+ *  @param xcor_len Length of each cross-correlation row
+ *  @param samples_per_m Cross-correlation samples per meter of path difference
+ *  @return 0 on success, negative on failure
+ *
+ *  A search keeps scratch space, so it can only be used by one thread at a
+ *  time.
+ */
+int search_init(search_t *s, const int res[3], const real_t size[3], real_t coarse_size,
+                int beam, const array_t *array, const locate_pair_t *pairs, int n_pairs,
+                int xcor_len, real_t samples_per_m)
+{
+	int n_blocks = (xcor_len + SEARCH_BLOCK - 1) / SEARCH_BLOCK;
+
+	memset(s, 0, sizeof(*s));
+	memcpy(s->res, res, sizeof(s->res));
+	memcpy(s->size, size, sizeof(s->size));
+	s->beam = beam;
+	s->array = array;
+	s->pairs = pairs;
+	s->n_pairs = n_pairs;
+	s->xcor_len = xcor_len;
+	s->samples_per_m = samples_per_m;
+
+	/* boxes are a power of two cells across, so they halve down to single
+	 * cells, and no bigger than the grid
+	 */
+	int max_res = res[0] > res[1] ? res[0] : res[1];
+	max_res = res[2] > max_res ? res[2] : max_res;
+	for (s->coarse = 1; s->coarse < max_res; s->coarse *= 2) {
+		int k;
+		for (k = 0; k < 3; k++) {
+			if (res[k] > 1 && 2 * s->coarse * (size[k] / res[k]) > coarse_size) {
+				break;
+			}
+		}
+		if (k < 3) {
+			break;
+		}
+	}
+	s->n_coarse = 1;
+	for (int k = 0; k < 3; k++) {
+		s->n_coarse *= res[k] > 1 ? (res[k] + s->coarse - 1) / s->coarse : 1;
+	}
+	s->heap_cap = s->n_coarse;
+
+	s->rows = malloc((size_t)n_pairs * xcor_len * sizeof(s->rows[0]));
+	s->block_max = malloc((size_t)n_pairs * n_blocks * sizeof(s->block_max[0]));
+	s->coarse_cells = malloc(s->n_coarse * sizeof(s->coarse_cells[0]));
+	s->heap = malloc(s->heap_cap * sizeof(s->heap[0]));
+	if (beam < 1 || s->rows == NULL || s->block_max == NULL || s->coarse_cells == NULL ||
+	    s->heap == NULL) {
+		search_free(s);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** @brief Frees memory allocated by `search_init`
+ *  @param s Search to free
+ */
+void search_free(search_t *s)
+{
+	free(s->rows);
+	free(s->block_max);
+	free(s->coarse_cells);
+	free(s->heap);
+	s->rows = s->block_max = NULL;
+	s->coarse_cells = s->heap = NULL;
+}
+
+/** @brief Works out where the centre of a grid cell is
+ *  @param s Search
+ *  @param idx Cell index in x, y and z
+ *  @return Position, in meters
+ *
+ *  Rows count down from the top, like `field_t`, and this is the same
+ *  arithmetic as `field_lags`, so cells get exactly the same lags.
+ */
+static vec3_t cell_pos(const search_t *s, const int idx[3])
+{
+	real_t step_x = s->size[0] / (real_t)s->res[0], step_y = s->size[1] / (real_t)s->res[1];
+	real_t step_z = s->size[2] / (real_t)s->res[2];
+	real_t x0 = -s->size[0] * 0.5 + step_x * 0.5, z0 = -s->size[2] * 0.5 + step_z * 0.5;
+	vec3_t pos;
+
+	pos.x = x0 + step_x * (real_t)idx[0];
+	pos.y = s->size[1] * 0.5 - step_y * ((real_t)idx[1] + 0.5);
+	pos.z = s->res[2] > 1 ? z0 + step_z * (real_t)idx[2] : 0.0;
+	return pos;
+}
+
+/** @brief Finds the largest value in part of a cross-correlation row
+ *  @param s Search
+ *  @param p Pair number
+ *  @param lo First index
+ *  @param hi Last index
+ *  @return Largest value
+ */
+static real_t row_max(const search_t *s, int p, int lo, int hi)
+{
+	int n_blocks = (s->xcor_len + SEARCH_BLOCK - 1) / SEARCH_BLOCK;
+	const real_t *row = s->rows + (size_t)s->xcor_len * p;
+	const real_t *block_max = s->block_max + (size_t)n_blocks * p;
+	int b_lo = (lo + SEARCH_BLOCK - 1) / SEARCH_BLOCK, b_hi = (hi + 1) / SEARCH_BLOCK;
+	real_t max = 0.0;
+
+	/* whole blocks in the middle, single samples at the ends */
+	if (b_lo >= b_hi) {
+		b_lo = b_hi = (hi + 1 + SEARCH_BLOCK - 1) / SEARCH_BLOCK;
+	}
+	for (int i = lo; i < b_lo * SEARCH_BLOCK && i <= hi; i++) {
+		max = row[i] > max ? row[i] : max;
+	}
+	for (int b = b_lo; b < b_hi; b++) {
+		max = block_max[b] > max ? block_max[b] : max;
+	}
+	for (int i = b_hi * SEARCH_BLOCK > lo ? b_hi * SEARCH_BLOCK : lo; i <= hi; i++) {
+		max = row[i] > max ? row[i] : max;
+	}
+
+	return max;
+}
+
+/** @brief Scores a single cell
+ *  @param s Search
+ *  @param idx Cell index in x, y and z
+ *  @return Sum over pairs of the (clamped) cross-correlation at the cell's lag
+ */
+static real_t cell_score(const search_t *s, const int idx[3])
+{
+	const array_t *array = s->array;
+	int half = s->xcor_len / 2, last = s->xcor_len - 1 - half;
+	vec3_t pos = cell_pos(s, idx);
+	real_t d[ARRAY_MICS_MAX], score = 0.0;
+
+	for (int m = 0; m < array->n_mics; m++) {
+		vec3_t p = array->pos[m];
+		real_t dyz = (pos.y - p.y) * (pos.y - p.y) + (pos.z - p.z) * (pos.z - p.z);
+		real_t late = array->delay[m] * SND_SPEED * s->samples_per_m;
+		real_t dx = pos.x - p.x;
+		d[m] = sqrt(dx * dx + dyz) * s->samples_per_m + late;
+	}
+
+	for (int p = 0; p < s->n_pairs; p++) {
+		const real_t *row = s->rows + (size_t)s->xcor_len * p + half;
+		real_t dd = d[s->pairs[p].a] - d[s->pairs[p].b];
+		int ds = (int)(dd + (dd < 0.0 ? -0.5 : 0.5));
+		ds = ds < -half ? -half : ds > last ? last : ds;
+		score += row[ds];
+	}
+
+	return score;
+}
+
+/** @brief Bounds the score of every cell in a box
+ *  @param s Search
+ *  @param c Box
+ *  @return Upper bound on the score of any cell in the box
+ *
+ *  A pair's path difference |x - a| - |x - b| changes at most as fast as
+ *  the difference of the unit vectors from the mics to x, which over a ball
+ *  of radius r around the box's centre c can't be more than at c plus
+ *  r / (|c - a| - r) + r / (|c - b| - r), nor ever more than 2.
+ */
+static real_t box_score(const search_t *s, const struct search_cell *c)
+{
+	const array_t *array = s->array;
+	int half = s->xcor_len / 2, last = s->xcor_len - 1 - half;
+	vec3_t lo = cell_pos(s, c->lo), centre, u[ARRAY_MICS_MAX];
+	int hi_idx[3] = { c->hi[0] - 1, c->hi[1] - 1, c->hi[2] - 1 };
+	vec3_t hi = cell_pos(s, hi_idx);
+	real_t d[ARRAY_MICS_MAX], late[ARRAY_MICS_MAX], r, score = 0.0;
+
+	centre = vec3_scale(vec3_add(lo, hi), 0.5);
+	r = vec3_dist(lo, hi) * 0.5;
+
+	for (int m = 0; m < array->n_mics; m++) {
+		vec3_t v = vec3_sub(centre, array->pos[m]);
+		d[m] = vec3_dist(v, vec3_zero);
+		u[m] = d[m] > 0.0 ? vec3_scale(v, 1.0 / d[m]) : vec3_zero;
+		late[m] = array->delay[m] * SND_SPEED;
+	}
+
+	for (int p = 0; p < s->n_pairs; p++) {
+		int a = s->pairs[p].a, b = s->pairs[p].b;
+		real_t g = 2.0;
+
+		if (d[a] > r && d[b] > r) {
+			g = vec3_dist(u[a], u[b]) + r / (d[a] - r) + r / (d[b] - r);
+			g = g < 2.0 ? g : 2.0;
+		}
+
+		/* one more sample either side for rounding */
+		real_t f = (d[a] - d[b] + late[a] - late[b]) * s->samples_per_m;
+		real_t w = r * g * s->samples_per_m + 1.0;
+		int l = (int)floor(f - w), h = (int)ceil(f + w);
+		l = l < -half ? -half : l > last ? last : l;
+		h = h < -half ? -half : h > last ? last : h;
+		score += row_max(s, p, l + half, h + half);
+	}
+
+	return score;
+}
+
+/** @brief Tells whether a box is a single cell
+ *  @param c Box
+ *  @return Nonzero if it is
+ */
+static int is_cell(const struct search_cell *c)
+{
+	return c->hi[0] - c->lo[0] == 1 && c->hi[1] - c->lo[1] == 1 && c->hi[2] - c->lo[2] == 1;
+}
+
+/** @brief Scores a box, exactly if it's a single cell
+ *  @param s Search
+ *  @param c Box; its score is filled in
+ */
+static void score(const search_t *s, struct search_cell *c)
+{
+	c->score = is_cell(c) ? cell_score(s, c->lo) : box_score(s, c);
+}
+
+/** @brief Tells whether one box should be looked at before another
+ *  @param a First box
+ *  @param b Second box
+ *  @return Nonzero if `a` comes first
+ *
+ *  Higher scores first. On a tie boxes go before cells, since they might
+ *  hold a cell that ties too, and cells go in the order `field_peaks` scans
+ *  them, which keeps the first.
+ */
+static int cell_before(const struct search_cell *a, const struct search_cell *b)
+{
+	if (a->score != b->score) {
+		return a->score > b->score;
+	}
+	if (is_cell(a) != is_cell(b)) {
+		return is_cell(b);
+	}
+	for (int k = 2; k >= 0; k--) {
+		if (a->lo[k] != b->lo[k]) {
+			return a->lo[k] < b->lo[k];
+		}
+	}
+	return 0;
+}
+
+static int cell_cmp(const void *a, const void *b)
+{
+	return cell_before(a, b) ? -1 : cell_before(b, a) ? 1 : 0;
+}
+
+/** @brief Adds a box to the heap
+ *  @param s Search
+ *  @param n Number of boxes in the heap
+ *  @param c Box to add
+ *  @return 0 on success, negative on failure
+ */
+static int heap_push(search_t *s, int n, const struct search_cell *c)
+{
+	int i = n;
+
+	if (n == s->heap_cap) {
+		struct search_cell *heap = realloc(s->heap, 2 * s->heap_cap * sizeof(heap[0]));
+		if (heap == NULL) {
+			return -1;
+		}
+		s->heap = heap;
+		s->heap_cap *= 2;
+	}
+
+	for (; i > 0 && cell_before(c, &s->heap[(i - 1) / 2]); i = (i - 1) / 2) {
+		s->heap[i] = s->heap[(i - 1) / 2];
+	}
+	s->heap[i] = *c;
+	return 0;
+}
+
+/** @brief Takes the first box off the heap
+ *  @param s Search
+ *  @param n Number of boxes in the heap, at least one
+ *  @return The box
+ */
+static struct search_cell heap_pop(search_t *s, int n)
+{
+	struct search_cell top = s->heap[0], last = s->heap[n - 1];
+	int i = 0;
+
+	n--;
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= n) {
+			break;
+		}
+		if (child + 1 < n && cell_before(&s->heap[child + 1], &s->heap[child])) {
+			child++;
+		}
+		if (!cell_before(&s->heap[child], &last)) {
+			break;
+		}
+		s->heap[i] = s->heap[child];
+		i = child;
+	}
+	s->heap[i] = last;
+
+	return top;
+}
+
+/** @brief Works out where a peak in a cell is reported
+ *  @param s Search
+ *  @param idx Cell index in x, y and z
+ *  @return Position, in meters, with the same arithmetic as `field_peaks`
+ */
+static vec3_t peak_pos(const search_t *s, const int idx[3])
+{
+	vec3_t pos = cell_pos(s, idx);
+
+	pos.x = -s->size[0] * 0.5 + s->size[0] / (real_t)s->res[0] * ((real_t)idx[0] + 0.5);
+	return pos;
+}
+
+/** @brief Tells whether a box is too close to a peak already found
+ *  @param s Search
+ *  @param c Box
+ *  @param radius Minimum distance between peaks, in meters
+ *  @param peaks Peaks found so far
+ *  @param n_found Number of peaks found so far
+ *  @return Nonzero if every cell in the box is too close
+ *
+ *  Single cells are checked with the same arithmetic as `field_peaks`;
+ *  boxes only when they are well inside the radius, and are split otherwise.
+ */
+static int too_close(const search_t *s, const struct search_cell *c, real_t radius,
+                     const field_peak_t *peaks, int n_found)
+{
+	real_t r2 = radius * radius;
+
+	if (is_cell(c)) {
+		vec3_t pos = peak_pos(s, c->lo);
+		for (int k = 0; k < n_found; k++) {
+			real_t dx = pos.x - peaks[k].x, dy = pos.y - peaks[k].y, dz = pos.z - peaks[k].z;
+			if (dx * dx + dy * dy + dz * dz < r2) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	int hi_idx[3] = { c->hi[0] - 1, c->hi[1] - 1, c->hi[2] - 1 };
+	vec3_t lo = cell_pos(s, c->lo), hi = cell_pos(s, hi_idx);
+	for (int k = 0; k < n_found; k++) {
+		vec3_t p = { peaks[k].x, peaks[k].y, peaks[k].z };
+		vec3_t far = {
+			fabs(lo.x - p.x) > fabs(hi.x - p.x) ? lo.x - p.x : hi.x - p.x,
+			fabs(lo.y - p.y) > fabs(hi.y - p.y) ? lo.y - p.y : hi.y - p.y,
+			fabs(lo.z - p.z) > fabs(hi.z - p.z) ? lo.z - p.z : hi.z - p.z,
+		};
+		if (far.x * far.x + far.y * far.y + far.z * far.z < r2 * 0.999) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** @brief Finds the highest peaks in one frame
+ *  @param s Search
+ *  @param xcor Cross-correlation rows from `locate_xcor`
+ *  @param n_peaks Maximum number of peaks to find
+ *  @param radius Minimum distance between peaks, in meters
+ *  @param peaks Output; peaks in decreasing order of score
+ *  @return Number of peaks found, or negative on failure
+ */
+int search_peaks(search_t *s, const real_t *xcor, int n_peaks, real_t radius, field_peak_t *peaks)
+{
+	int n_blocks = (s->xcor_len + SEARCH_BLOCK - 1) / SEARCH_BLOCK, n = 0, n_found = 0;
+	int coarse[3], keep;
+
+	/* clamp once, and find the maximum of each block for the bounds */
+	for (int p = 0; p < s->n_pairs; p++) {
+		const real_t *src = xcor + (size_t)s->xcor_len * p;
+		real_t *row = s->rows + (size_t)s->xcor_len * p;
+		real_t *block_max = s->block_max + (size_t)n_blocks * p;
+
+		for (int i = 0; i < s->xcor_len; i++) {
+			real_t v = src[i];
+			row[i] = v < 0.0 ? 0.0 : v > 1.0 ? 1.0 : v;
+		}
+		for (int b = 0; b < n_blocks; b++) {
+			int end = (b + 1) * SEARCH_BLOCK < s->xcor_len ? (b + 1) * SEARCH_BLOCK : s->xcor_len;
+			real_t max = 0.0;
+			for (int i = b * SEARCH_BLOCK; i < end; i++) {
+				max = row[i] > max ? row[i] : max;
+			}
+			block_max[b] = max;
+		}
+	}
+
+	/* bound the coarse boxes, and keep the best */
+	for (int k = 0; k < 3; k++) {
+		coarse[k] = s->res[k] > 1 ? s->coarse : 1;
+	}
+	for (int z = 0; z < s->res[2]; z += coarse[2]) {
+		for (int y = 0; y < s->res[1]; y += coarse[1]) {
+			for (int x = 0; x < s->res[0]; x += coarse[0]) {
+				struct search_cell *c = &s->coarse_cells[n++];
+				int lo[3] = { x, y, z };
+				for (int k = 0; k < 3; k++) {
+					c->lo[k] = lo[k];
+					c->hi[k] = lo[k] + coarse[k] < s->res[k] ? lo[k] + coarse[k] : s->res[k];
+				}
+				score(s, c);
+			}
+		}
+	}
+	qsort(s->coarse_cells, n, sizeof(s->coarse_cells[0]), cell_cmp);
+	keep = n < s->beam * n_peaks ? n : s->beam * n_peaks;
+
+	n = 0;
+	for (int i = 0; i < keep; i++) {
+		if (heap_push(s, n++, &s->coarse_cells[i]) < 0) {
+			return -1;
+		}
+	}
+
+	/* split the best box until a cell comes out on top */
+	while (n > 0 && n_found < n_peaks) {
+		struct search_cell c = heap_pop(s, n--);
+		int mid[3], n_split[3];
+
+		if (too_close(s, &c, radius, peaks, n_found)) {
+			continue;
+		}
+		if (is_cell(&c)) {
+			vec3_t pos = peak_pos(s, c.lo);
+			peaks[n_found].x = pos.x;
+			peaks[n_found].y = pos.y;
+			peaks[n_found].z = pos.z;
+			peaks[n_found].score = c.score;
+			n_found++;
+			continue;
+		}
+
+		for (int k = 0; k < 3; k++) {
+			n_split[k] = c.hi[k] - c.lo[k] > 1 ? 2 : 1;
+			mid[k] = c.lo[k] + (c.hi[k] - c.lo[k] + 1) / 2;
+		}
+		for (int j = 0; j < n_split[0] * n_split[1] * n_split[2]; j++) {
+			int side[3] = { j % n_split[0], j / n_split[0] % n_split[1],
+			                j / (n_split[0] * n_split[1]) };
+			struct search_cell child;
+
+			for (int k = 0; k < 3; k++) {
+				child.lo[k] = n_split[k] == 1 || !side[k] ? c.lo[k] : mid[k];
+				child.hi[k] = n_split[k] == 1 || side[k] ? c.hi[k] : mid[k];
+			}
+			score(s, &child);
+			if (heap_push(s, n++, &child) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	return n_found;
+}
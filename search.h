@@ -0,0 +1,46 @@
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include "array.h"
+#include "field.h"
+#include "globals.h"
+#include "locate.h"
+
+#define SEARCH_BEAM_DEFAULT 16 /* coarse boxes kept per source sought */
+
+/* one box of cells in a search */
+struct search_cell {
+	int lo[3], hi[3]; /* range of grid cells in x, y and z */
+	real_t score;     /* exact for a single cell, an upper bound otherwise */
+};
+
+/* coarse-to-fine search for the peaks of the steered-response power over a
+ * grid centred on (0,0,0), the same grid `field_t` evaluates in full
+ */
+typedef struct {
+	int res[3];                 /* grid size, in cells; zres 1 for the z = 0 plane */
+	real_t size[3];             /* grid extent, in meters; depth 0 for the plane */
+	int coarse;                 /* cells per side of the boxes searched first */
+	int beam;                   /* coarse boxes refined, per peak sought */
+	const array_t *array;
+	const locate_pair_t *pairs; /* mic pair of each cross-correlation row */
+	int n_pairs;
+	int xcor_len;               /* length of each cross-correlation row */
+	real_t samples_per_m;       /* cross-correlation samples per meter of path difference */
+
+	/* per-search scratch */
+	real_t *rows;               /* clamped cross-correlation rows */
+	real_t *block_max;          /* maximum of each SEARCH_BLOCK of each row */
+	struct search_cell *coarse_cells;
+	int n_coarse;
+	struct search_cell *heap;   /* boxes still to look at, best first */
+	int heap_cap;
+} search_t;
+
+int search_init(search_t *s, const int res[3], const real_t size[3], real_t coarse_size,
+                int beam, const array_t *array, const locate_pair_t *pairs, int n_pairs,
+                int xcor_len, real_t samples_per_m);
+void search_free(search_t *s);
+int search_peaks(search_t *s, const real_t *xcor, int n_peaks, real_t radius, field_peak_t *peaks);
+
+#endif /* _SEARCH_H_ */
@@ -1,27 +1,23 @@
 #version 130
 
-const int N_MICS = 12;
-
 uniform sampler2D u_correlation;
-uniform float u_samples_per_m;
+uniform isampler2DArray u_lags; /* lag of each pair at each cell, top row first */
+uniform int u_n_pairs;
+uniform vec2 u_extent;          /* size of the field, in meters */
 uniform float u_intensity;
-uniform vec3 u_mic_pos[N_MICS];
 
 in vec2 coord;
 
 void main(void)
 {
-	int fft_half = textureSize(u_correlation, 0).x / 2;
+	ivec2 res = textureSize(u_lags, 0).xy;
+	ivec2 cell = ivec2((vec2(coord.x, -coord.y) / u_extent + 0.5) * vec2(res));
 	float acc = 0.0;
-	for (int i = 0; i < N_MICS; i++) {
-		int i_next = (i + 1) % N_MICS;
-		vec3 p0 = u_mic_pos[i];
-		vec3 p1 = u_mic_pos[i_next];
-		vec3 pos = vec3(coord, 0.0);
-		float dt = distance(p0, pos) - distance(p1, pos);
-		int ds = int(round(dt * u_samples_per_m));
 
-		acc += clamp(texelFetch(u_correlation, ivec2(fft_half + ds, i), 0).r, 0.0, 1.0);
+	cell = clamp(cell, ivec2(0), res - 1);
+	for (int i = 0; i < u_n_pairs; i++) {
+		int lag = texelFetch(u_lags, ivec3(cell, i), 0).r;
+		acc += clamp(texelFetch(u_correlation, ivec2(lag, i), 0).r, 0.0, 1.0);
 	}
 
 	acc *= acc;
@@ -0,0 +1,239 @@
+/** @file stream.c
+ *  @brief Bounded-memory reading of long WAV files
+ *
+ *  Keeps a ring of the most recently read samples of a file. Frames that
+ *  overlap the previous ones only need the new part read from disk and
+ *  converted, and anything older than the ring holds is forgotten, so a
+ *  recording of any length can be processed in a few kilobytes per channel.
+ *  Samples are kept as 16-bit integers, half the size of floats.
+ *  Reading is meant to go forward; going back works, but starts over.
+ *
+ *  Multichannel files are read with one sequential read per chunk and
+ *  deinterleaved into a ring per channel as they come in.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "wav.h"
+
+/** @brief Opens a WAV file for streaming
+ *  @param s Output; the stream
+ *  @param filename Name of file to open
+ *  @param cap Largest number of samples per channel that will be read at once
+ *  @return 0 on success, negative on failure
+ */
+int stream_open(stream_t *s, const char *filename, size_t cap)
+{
+	memset(s, 0, sizeof(*s));
+
+	s->fd = wav_open(filename, &s->info, &s->data_offset);
+	if (s->fd < 0) {
+		return -1;
+	}
+	s->filename = strdup(filename);
+	s->cap = cap;
+	s->ring = calloc(s->info.chans, sizeof(s->ring[0]));
+	s->raw = malloc(cap * s->info.chans * sizeof(s->raw[0]));
+	if (s->filename == NULL || s->ring == NULL || s->raw == NULL) {
+		goto fail;
+	}
+	for (int c = 0; c < s->info.chans; c++) {
+		if ((s->ring[c] = malloc(cap * sizeof(s->ring[c][0]))) == NULL) {
+			goto fail;
+		}
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(s->fd, s->data_offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: cannot allocate stream buffers\n", filename);
+	stream_close(s);
+	return -1;
+}
+
+/** @brief Closes a stream
+ *  @param s Stream to close
+ */
+void stream_close(stream_t *s)
+{
+	if (s->fd >= 0) {
+		close(s->fd);
+	}
+	for (int c = 0; s->ring != NULL && c < s->info.chans; c++) {
+		free(s->ring[c]);
+	}
+	free(s->filename);
+	free(s->ring);
+	free(s->raw);
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+}
+
+/** @brief Reads samples from the file into the ring until it holds `end`
+ *  @param s Stream to fill
+ *  @param end Sample to fill up to, at most `s->cap` past `s->start`
+ *  @return 0 on success, negative on failure
+ */
+static int fill(stream_t *s, size_t end)
+{
+	size_t frame = s->info.chans * sizeof(s->raw[0]);
+	size_t n = end - s->end;
+	size_t in_file = s->end >= s->info.len ? 0 : s->info.len - s->end;
+	size_t got = 0, at, first;
+
+	in_file = in_file < n ? in_file : n;
+	while (got < in_file * frame) {
+		ssize_t ret = pread(s->fd, (char*)s->raw + got, in_file * frame - got,
+		                    s->data_offset + (off_t)s->end * frame + got);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			fprintf(stderr, "%s: read failed at sample %zu: %s\n", s->filename,
+			        s->end + got / frame, ret < 0 ? strerror(errno) : "unexpected end of file");
+			return -1;
+		}
+		got += ret;
+	}
+
+	/* deinterleave in at most two pieces, around the end of the ring */
+	at = s->end % s->cap;
+	first = s->cap - at < in_file ? s->cap - at : in_file;
+	wav_deinterleave(s->raw, s->info.chans, first, s->ring, at);
+	wav_deinterleave(s->raw + first * s->info.chans, s->info.chans, in_file - first, s->ring, 0);
+
+	/* anything past the end of the file reads as silence */
+	for (size_t i = in_file; i < n; i++) {
+		for (int c = 0; c < s->info.chans; c++) {
+			s->ring[c][(s->end + i) % s->cap] = 0;
+		}
+	}
+
+	s->end = end;
+	return 0;
+}
+
+/** @brief Reads a window of samples of every channel
+ *  @param s Stream to read from
+ *  @param start First sample to read
+ *  @param n Number of samples, at most the capacity given to `stream_open`
+ *  @param out Output; `n` samples for each channel, zero past the end of the
+ *             file
+ *  @return Number of samples actually in the file, or negative on failure
+ */
+ssize_t stream_read(stream_t *s, size_t start, size_t n, int16_t **out)
+{
+	size_t first, avail;
+
+	if (n > s->cap) {
+		return -1;
+	}
+
+	/* skip over anything not needed, or start over when going back */
+	if (start < s->start || start > s->end) {
+		s->start = s->end = start;
+	}
+	if (start + n > s->end) {
+		if (start + n - s->start > s->cap) {
+			s->start = start + n - s->cap;
+		}
+		if (fill(s, start + n) < 0) {
+			return -1;
+		}
+	}
+
+	first = start % s->cap;
+	first = s->cap - first < n ? s->cap - first : n;
+	for (int c = 0; c < s->info.chans; c++) {
+		memcpy(out[c], s->ring[c] + start % s->cap, first * sizeof(out[c][0]));
+		memcpy(out[c] + first, s->ring[c], (n - first) * sizeof(out[c][0]));
+	}
+
+	avail = start >= s->info.len ? 0 : s->info.len - start;
+	return avail < n ? avail : n;
+}
+
+/** @brief Opens the inputs of a mic array
+ *  @param streams Output; up to `n_chans` streams
+ *  @param input Either a WAV file with `n_chans` channels, or the prefix of
+ *               files named `<input>.0.wav`, `<input>.1.wav`... with
+ *               `n_chans` channels between them, usually one mono file per mic
+ *  @param n_chans Number of channels, i.e. mics
+ *  @param cap Largest number of samples per channel that will be read at once
+ *  @return Number of streams opened, or negative on failure
+ *
+ *  All inputs must have the same length and sample rate.
+ */
+int stream_open_array(stream_t *streams, const char *input, int n_chans, size_t cap)
+{
+	struct stat stats;
+	char buf[256];
+	int n = 0, chans = 0;
+
+	if (stat(input, &stats) == 0 && S_ISREG(stats.st_mode)) {
+		if (stream_open(&streams[0], input, cap) < 0) {
+			return -1;
+		}
+		if (streams[0].info.chans != n_chans) {
+			fprintf(stderr, "%s: %d channels, need one per mic (%d)\n", input,
+			        streams[0].info.chans, n_chans);
+			stream_close(&streams[0]);
+			return -1;
+		}
+		return 1;
+	}
+
+	for (n = 0; chans < n_chans; n++) {
+		snprintf(buf, 256, "%s.%d.wav", input, n);
+		if (stream_open(&streams[n], buf, cap) < 0) {
+			goto fail;
+		}
+		chans += streams[n].info.chans;
+		if (chans > n_chans ||
+		    (n > 0 && (streams[n].info.len != streams[0].info.len ||
+		               streams[n].info.rate != streams[0].info.rate))) {
+			fprintf(stderr, "%s: channels, length or rate differ from previous inputs\n", buf);
+			n++;
+			goto fail;
+		}
+	}
+
+	return n;
+
+fail:
+	while (n-- > 0) {
+		stream_close(&streams[n]);
+	}
+	return -1;
+}
+
+/** @brief Reads a window of samples of every channel of a mic array
+ *  @param streams Streams opened by `stream_open_array`
+ *  @param n_streams Number of streams
+ *  @param start First sample to read
+ *  @param n Number of samples
+ *  @param out Output; `n` samples for each channel
+ *  @return 0 on success, negative on failure
+ */
+int stream_read_array(stream_t *streams, int n_streams, size_t start, size_t n, int16_t **out)
+{
+	for (int i = 0; i < n_streams; i++) {
+		if (stream_read(&streams[i], start, n, out) < 0) {
+			return -1;
+		}
+		out += streams[i].info.chans;
+	}
+
+	return 0;
+}
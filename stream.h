@@ -0,0 +1,34 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "globals.h"
+#include "wav.h"
+
+/* 16-bit WAV file read front to back through a ring of samples per channel,
+ * so memory use depends on the window size instead of the length of the file;
+ * samples stay 16-bit, to be converted where they're used
+ */
+typedef struct {
+	int fd;
+	char *filename;
+	off_t data_offset;  /* byte offset of the first sample */
+	wav_info_t info;
+
+	int16_t **ring;     /* sample i of channel c lives at ring[c][i % cap] */
+	int16_t *raw;       /* scratch for `cap` interleaved samples from the file */
+	size_t cap;
+	size_t start, end;  /* samples [start, end) are in the ring */
+} stream_t;
+
+int stream_open(stream_t *s, const char *filename, size_t cap);
+void stream_close(stream_t *s);
+ssize_t stream_read(stream_t *s, size_t start, size_t n, int16_t **out);
+
+int stream_open_array(stream_t *streams, const char *input, int n_chans, size_t cap);
+int stream_read_array(stream_t *streams, int n_streams, size_t start, size_t n, int16_t **out);
+
+#endif /* _STREAM_H_ */
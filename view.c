@@ -10,21 +10,27 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
 
+#include "array.h"
+#include "field.h"
 #include "file.h"
 #include "globals.h"
 #include "liss.h"
 #include "locate.h"
+#include "pool.h"
+#include "stream.h"
 #include "vector.h"
-#include "wav.h"
+#include "whiten.h"
 
 #define XRES 1200
 #define YRES 1200
 #define WIDTH 12.0 /* meters */
 #define HEIGHT 12.0
 
+#define FIELD_RES 600 /* cells per side of the lag table; 2 bytes per cell per pair */
+
 #define XCOR_LEN 512 /* samples */
-#define XCOR_TEX_LEN 512
 #define XCOR_MUL 4 /* super-resolution factor */
 
 /* function prototypes */
@@ -40,23 +46,29 @@ static SDL_Surface *screen;
 static int need_draw, need_update = 1, view_mode = MODE_FIELD;
 
 /* data */
-#include "mic.c"
+static array_t array;
 
 static size_t n_samples, n_sources;
-static real_t *mic_data[N_MICS];
+static int paths = LISS_PLANE; /* drawn from above with -v */
+static stream_t mic_stream[ARRAY_MICS_MAX];
+static int n_streams;
+static int16_t mic_win[ARRAY_MICS_MAX][XCOR_LEN]; /* current frame of each input */
+static int16_t *mic_data[ARRAY_MICS_MAX];
 static real_t sample_rate;
-static real_t xcor_res[N_MICS * XCOR_LEN * XCOR_MUL];
+static real_t *xcor_res;
+static locate_pair_t *pairs;
+static int n_pairs;
+static field_t field; /* only its lag table is used, by the shader */
 
 static int cur_time, old_time, paused;
 
 /* gl stuff */
 GLuint shd_field, shd_points, shd_plot;
-GLuint tex_correlation;
-GLint u_correlation, u_mic_pos, u_samples_per_m, u_intensity;
+GLuint tex_correlation, tex_lags;
+GLint u_correlation, u_lags, u_n_pairs, u_extent, u_intensity;
 
 static double intensity = 0.0001;
-static float xcor_tex_data[N_MICS * XCOR_TEX_LEN * XCOR_MUL];
-static float mic_pos_data[N_MICS * 3];
+static float *xcor_tex_data;
 
 static void handle_event(SDL_Event *ev)
 {
@@ -111,7 +123,11 @@ static void update(void)
 		exit(0);
 	}
 
-	locate_xcor(mic_data, sample, xcor_res);
+	/* only the current frame is read */
+	if (stream_read_array(mic_stream, n_streams, sample, XCOR_LEN, mic_data) < 0) {
+		exit(1);
+	}
+	locate_xcor(mic_data, 0, xcor_res);
 }
 
 static void draw_field(void)
@@ -119,9 +135,10 @@ static void draw_field(void)
 	/* render field */
 	glUseProgram(shd_field);
 	glUniform1i(u_correlation, 0);
-	glUniform1f(u_samples_per_m, (sample_rate * XCOR_MUL) / SND_SPEED);
+	glUniform1i(u_lags, 1);
 	glUniform1f(u_intensity, intensity);
-	glUniform3fv(u_mic_pos, N_MICS, mic_pos_data);
+	glUniform1i(u_n_pairs, n_pairs);
+	glUniform2f(u_extent, WIDTH, HEIGHT);
 
 	glBegin(GL_TRIANGLE_STRIP);
 	glVertex2f( WIDTH * 0.5,  HEIGHT * 0.5);
@@ -134,12 +151,12 @@ static void draw_field(void)
 	glUseProgram(shd_points);
 	glColor4f(1.0, 0.0, 0.0, 1.0);
 	glBegin(GL_POINTS);
-	for (int i = 0; i < N_MICS; i++) {
-		glVertex2f(mic_pos[i].x, mic_pos[i].y);
+	for (int i = 0; i < array.n_mics; i++) {
+		glVertex2f(array.pos[i].x, array.pos[i].y);
 	}
 	glColor3f(1.0, 1.0, 0.0);
 	for (int i = 0; i < n_sources; i++) {
-		vec3_t pos = liss_pos(cur_time * 0.001 + (real_t)(XCOR_LEN / 2) / sample_rate, i);
+		vec3_t pos = liss_pos(cur_time * 0.001 + (real_t)(XCOR_LEN / 2) / sample_rate, paths, i);
 		glVertex2f(pos.x, pos.y);
 	}
 	glEnd();
@@ -161,15 +178,12 @@ static void draw_plot(void)
 static void draw(void)
 {
 	/* copy cross-correlation data into texture buffer */
-	for (int i = 0; i < N_MICS; i++) {
-		int offset_i = (i * XCOR_LEN + (XCOR_LEN - XCOR_TEX_LEN) / 2) * XCOR_MUL;
-		int offset_o = i * XCOR_TEX_LEN * XCOR_MUL;
-		for (int j = 0; j < XCOR_TEX_LEN * XCOR_MUL; j++) {
-			xcor_tex_data[j + offset_o] = xcor_res[j + offset_i];
-		}
+	int row_len = locate_row_len();
+	for (int i = 0; i < n_pairs * row_len; i++) {
+		xcor_tex_data[i] = xcor_res[i];
 	}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, XCOR_TEX_LEN * XCOR_MUL, N_MICS,
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, row_len, n_pairs,
 	             0, GL_RED, GL_FLOAT, xcor_tex_data);
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -241,6 +255,35 @@ fail:
 	exit(1);
 }
 
+/** @brief Works out which lag of each pair lands on each cell, for the shader
+ *
+ *  The table is the one `loc` uses, as one texture layer per pair with the
+ *  top row first, so the shader only has to look up and add.
+ */
+static void init_lags(void)
+{
+	GLint max_layers;
+
+	if (field_init(&field, FIELD_RES, FIELD_RES, WIDTH, HEIGHT, &array, pairs, n_pairs,
+	               locate_row_len(), (sample_rate * XCOR_MUL) / SND_SPEED) < 0) {
+		fprintf(stderr, "can't build lag table\n");
+		exit(1);
+	}
+
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+	if (n_pairs > max_layers) {
+		fprintf(stderr, "%d pairs, but GL only takes %d\n", n_pairs, max_layers);
+		exit(1);
+	}
+
+	glActiveTexture(GL_TEXTURE1);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16I, FIELD_RES, FIELD_RES, n_pairs,
+	             0, GL_RED_INTEGER, GL_SHORT, field.lags);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glActiveTexture(GL_TEXTURE0);
+}
+
 static void init(void)
 {
 	/* set up SDL */
@@ -265,6 +308,7 @@ static void init(void)
 
 	fprintf(stderr, "GL version: %s\n", glGetString(GL_VERSION));
 	fprintf(stderr, "GLSL version: %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+	fprintf(stderr, "whitening: %s\n", whiten_name());
 
 	/* set up coordinates - (0,0) is middle */
 	glMatrixMode(GL_MODELVIEW);
@@ -289,8 +333,9 @@ static void init(void)
 	shd_plot = create_shader("shaders/plot.vert", "shaders/plot.frag");
 
 	u_correlation = glGetUniformLocation(shd_field, "u_correlation");
-	u_mic_pos = glGetUniformLocation(shd_field, "u_mic_pos");
-	u_samples_per_m = glGetUniformLocation(shd_field, "u_samples_per_m");
+	u_lags = glGetUniformLocation(shd_field, "u_lags");
+	u_n_pairs = glGetUniformLocation(shd_field, "u_n_pairs");
+	u_extent = glGetUniformLocation(shd_field, "u_extent");
 	u_intensity = glGetUniformLocation(shd_field, "u_intensity");
 
 	/* set up cross-correlation texture */
@@ -300,22 +345,17 @@ static void init(void)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-	/* get mic positions compatible with GL uniform */
-	for (int i = 0, j = 0; i < N_MICS; i++) {
-		mic_pos_data[j++] = mic_pos[i].x;
-		mic_pos_data[j++] = mic_pos[i].y;
-		mic_pos_data[j++] = mic_pos[i].z;
-	}
+	/* and the lag table, one layer per pair, filled in once the rate is known */
+	glGenTextures(1, &tex_lags);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tex_lags);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glActiveTexture(GL_TEXTURE0);
 
 	SDL_WM_SetCaption("you can run, but you can't hide", "unless you're quiet");
 	atexit(SDL_Quit);
 
-	/* initialize data structures */
-	if (locate_init(XCOR_LEN, N_MICS, XCOR_MUL) < 0) {
-		fprintf(stderr, "locate init failed");
-		exit(1);
-	}
-
 	/* initialize update timer */
 	if (SDL_AddTimer(25, timer_cb, NULL) == NULL) {
 		fprintf(stderr, "error setting update timer...\n");
@@ -326,31 +366,76 @@ static void init(void)
 int main(int argc, char **argv)
 {
 	SDL_Event ev;
-	char buf[256];
-	int32_t wav_rate;
-	size_t len = 0;
+	const char *pair_spec;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:v")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (array_load(optarg, &array) < 0) {
+				return 1;
+			}
+			break;
+		case 'v': paths = LISS_VOLUME; break;
+		default: optind = argc; break;
+		}
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "usage: %s [-a <array file>] [-v] <input> <n_sources> [ring|all|<pair list>]\n",
+		        argv[0]);
+		return 1;
+	}
 
-	if (argc < 3) {
-		fprintf(stderr, "usage: %s <file_prefix> <n_sources>\n", argv[0]);
+	if (array.n_mics == 0) {
+		array_default(&array);
+	}
+	pair_spec = argc - optind > 2 ? argv[optind + 2] : array.pairs[0] ? array.pairs : "ring";
+	pairs = locate_pairs(pair_spec, array.n_mics, &n_pairs);
+	if (pairs == NULL) {
+		fprintf(stderr, "bad mic pairs\n");
 		return 1;
 	}
 
 	init();
 
-	for (int i = 0; i < N_MICS; i++) {
-		size_t prev_len = len;
-		snprintf(buf, 256, "%s.%d.wav", argv[1], i);
-		fprintf(stderr, "input %2d: %s\n", i, buf);
-		mic_data[i] = wav_read_mono_16(buf, &wav_rate, &len);
-		if (mic_data[i] == NULL || (prev_len > 0 && len != prev_len)) {
-			fprintf(stderr, "dfuq?\n");
-			return 1;
-		}
+	/* one multichannel file or a file per mic */
+	n_streams = stream_open_array(mic_stream, argv[optind], array.n_mics, XCOR_LEN);
+	if (n_streams < 0) {
+		fprintf(stderr, "dfuq?\n");
+		return 1;
+	}
+	for (int i = 0; i < array.n_mics; i++) {
+		mic_data[i] = mic_win[i];
 	}
 
-	n_samples = len;
-	n_sources = atoi(argv[2]);
-	sample_rate = (real_t)wav_rate;
+	n_samples = mic_stream[0].info.len;
+	n_sources = atoi(argv[optind + 1]);
+	sample_rate = (real_t)mic_stream[0].info.rate;
+
+	/* initialize data structures - only lags possible with this array */
+	locate_cfg_t cfg = {
+		.n_samples = XCOR_LEN,
+		.n_mics = array.n_mics,
+		.upres = XCOR_MUL,
+		.pairs = pairs,
+		.n_pairs = n_pairs,
+		.max_lag = locate_max_lags(array.pos, array.delay, pairs, n_pairs, sample_rate),
+		.effort = LOCATE_PLAN_MEASURE,
+		.pool = pool_create(0), /* split each frame among all cores */
+		.samples = LOCATE_SAMPLES_INT16,
+	};
+	if (cfg.max_lag == NULL || locate_init(&cfg) < 0) {
+		fprintf(stderr, "locate init failed\n");
+		return 1;
+	}
+
+	xcor_res = malloc((size_t)n_pairs * locate_row_len() * sizeof(xcor_res[0]));
+	xcor_tex_data = malloc((size_t)n_pairs * locate_row_len() * sizeof(xcor_tex_data[0]));
+	if (xcor_res == NULL || xcor_tex_data == NULL) {
+		fprintf(stderr, "can't allocate cross-correlation buffers\n");
+		return 1;
+	}
+	init_lags();
 
 	printf(
 		"space: pause\n"
@@ -1,18 +1,25 @@
 /** @file wav.c
  *  @brief Functions to handle WAV file reading and writing
+ *
+ *  Reading takes 16-bit PCM with any number of channels, plain or
+ *  WAVE_FORMAT_EXTENSIBLE. Writing does plain 16-bit PCM, a block at a time;
+ *  the sizes in the header are filled in once the length is known.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "wav.h"
 #include "file.h"
+#include "wav.h"
 
 typedef struct {
 	struct {
@@ -36,7 +43,27 @@ typedef struct {
 	} data;
 } wav_t;
 
-static wav_t wav_header_mono_16 = {
+/* contents of a 'fmt ' chunk, up to the end of the WAVE_FORMAT_EXTENSIBLE
+ * fields; only the first two bytes of the subformat GUID matter
+ */
+typedef struct {
+	int16_t tag;
+	int16_t chans;
+	int32_t rate;
+	int32_t byps;
+	int16_t align;
+	int16_t bps;
+	int16_t ext_size;
+	int16_t valid_bps;
+	int32_t chan_mask;
+	int16_t sub_tag;
+	char sub_guid[14];
+} wav_fmt_t;
+
+#define WAVE_FORMAT_PCM        0x0001
+#define WAVE_FORMAT_EXTENSIBLE ((int16_t)0xfffe)
+
+static const wav_t wav_header_mono_16 = {
 	.hdr = {
 		.magic  = {'R', 'I', 'F', 'F'},
 		.size   = 36,
@@ -58,13 +85,12 @@ static wav_t wav_header_mono_16 = {
 	},
 };
 
-/** @brief Reads a data chunk from a WAV file
- *  @param dst Location to copy data to
- *  @param src Beginning of chunk to read from
- *  @param src_end End of source data; will not read past here
- *  @param magic Magic value (4 bytes) to check for
- *  @param to_read Number of bytes to read
- *  @return Size of chunk (number of bytes from src to end of chunk)
+/** @brief Finds a chunk in a RIFF file
+ *  @param file Beginning of file
+ *  @param avail Number of bytes of the file available at `file`
+ *  @param magic Magic value (4 bytes) of chunk to find
+ *  @param size_out Output; size of chunk contents
+ *  @return Offset of chunk contents, or negative if not found
  *
  *  Chunk format is as per the RIFF spec:
  *  byte 0 1 2 3 4 5 6 7 8 9 ...
@@ -72,134 +98,384 @@ static wav_t wav_header_mono_16 = {
  *
  *  I really didn't want to do this, but it turns out not all WAV files have
  *  the same size header. One WAV file I encountered had a fmt section with a
- *  length of 0x12 = 18 instead of 0x10 = 16 like it really should be. This
- *  code is more complex than I'd like but at least it's more robust.
+ *  length of 0x12 = 18 instead of 0x10 = 16 like it really should be, and
+ *  recorders like to put LIST and other chunks anywhere. So chunks are looked
+ *  for by name, skipping anything else.
  */
-static ssize_t read_chunk(char *dst, char *src, char *src_end, char *magic, ssize_t to_read)
+static ssize_t find_chunk(const char *file, ssize_t avail, const char *magic, uint32_t *size_out)
 {
-	int32_t size;
+	ssize_t offset = offsetof(wav_t, fmt);
+	uint32_t size;
+
+	while (offset + 8 <= avail) {
+		memcpy(&size, file + offset + 4, 4);
+		if (!memcmp(file + offset, magic, 4)) {
+			*size_out = size;
+			return offset + 8;
+		}
+		offset += 8 + (ssize_t)size + (size & 1); /* chunks are padded to even lengths */
+	}
+
+	return -1;
+}
+
+/** @brief Validates the headers of a 16-bit PCM WAV file
+ *  @param filename Name of file, for error messages
+ *  @param file Beginning of file
+ *  @param avail Number of bytes of the file available at `file`
+ *  @param total_size Size of the whole file
+ *  @param info Output; format of the file
+ *  @return Offset of the first sample in the file, or negative on failure
+ *
+ *  Takes plain PCM and WAVE_FORMAT_EXTENSIBLE with a PCM subformat, with any
+ *  number of interleaved channels.
+ */
+static ssize_t parse_header(const char *filename, const char *file, ssize_t avail,
+                            ssize_t total_size, wav_info_t *info)
+{
+	wav_fmt_t fmt = { 0 };
+	ssize_t offset, wav_len, file_len;
+	uint32_t size;
+
+	if (avail < sizeof(wav_t)) {
+		fprintf(stderr, "%s: too short to be a WAV file\n", filename);
+		return -1;
+	}
+	if (memcmp(file, "RIFF", 4) || memcmp(file + 8, "WAVE", 4)) {
+		fprintf(stderr, "%s: not a RIFF WAVE file\n", filename);
+		return -1;
+	}
+
+	/* read format info chunk */
+	offset = find_chunk(file, avail, "fmt ", &size);
+	if (offset < 0 || size < 16 || offset + size > avail) {
+		fprintf(stderr, "%s: bad or missing 'fmt ' chunk\n", filename);
+		return -1;
+	}
+	memcpy(&fmt, file + offset, size < sizeof(fmt) ? size : sizeof(fmt));
 
-	/* chunk must be long enough */
-	if (src + to_read > src_end) {
+	/* only accept 16-bit PCM */
+	if (fmt.tag == WAVE_FORMAT_EXTENSIBLE && size >= sizeof(fmt)) {
+		fmt.tag = fmt.sub_tag;
+	}
+	if (fmt.tag != WAVE_FORMAT_PCM || fmt.bps != 16 || fmt.chans < 1 ||
+	    fmt.align != fmt.chans * 2) {
+		fprintf(stderr, "%s: unsupported file type - format 0x%04x, %d channels, %d bit\n",
+		        filename, (uint16_t)fmt.tag, fmt.chans, fmt.bps);
 		return -1;
 	}
 
-	/* chunk must match given magic */
-	if (memcmp(src, magic, 4)) {
+	/* find data chunk */
+	offset = find_chunk(file, avail, "data", &size);
+	if (offset < 0) {
+		fprintf(stderr, "%s: no 'data' chunk in the first %zd bytes\n", filename, avail);
 		return -1;
 	}
 
-	memcpy(dst, src, to_read);
-	size = *(int32_t*)(src + 4);
-	return size + 8;
+	/* use the shorter of the header-specified size or the file size */
+	wav_len = size / fmt.align;
+	file_len = (total_size - offset) / fmt.align;
+
+	info->rate = fmt.rate;
+	info->chans = fmt.chans;
+	info->len = wav_len > file_len ? file_len : wav_len;
+	return offset;
 }
 
-/** @brief Reads a 16-bit mono WAV file as array of floating point samples
- *  @param filename Name of file to read
- *  @param sample_rate_out Output; sample rate of WAV file
- *  @param len_out Output; number of samples
- *  @return Array of samples, or NULL on failure
+/** @brief Splits interleaved samples into one array per channel
+ *  @param in Interleaved samples
+ *  @param chans Number of channels; give a constant so loops can vectorize
+ *  @param n Number of samples per channel
+ *  @param out Output; one array per channel
+ *  @param at Offset in each output array to start writing at
  */
-real_t *wav_read_mono_16(const char *filename, int32_t *sample_rate_out, size_t *len_out)
+static inline void deinterleave(const int16_t *in, int chans, size_t n, int16_t **out, size_t at)
 {
-	wav_t wav_header = wav_header_mono_16;
-	real_t *samples = NULL;
-	ssize_t total_size, wav_len, file_len, len, chunk_len;
-	ssize_t offset = offsetof(wav_t, fmt);
+	for (int c = 0; c < chans; c++) {
+		int16_t *dst = out[c] + at;
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = in[i * chans + c];
+		}
+	}
+}
 
-	char *file_end, *file = file_read(filename, &total_size);
-	if (file == NULL) {
-		goto out;
+/** @brief Splits interleaved 16-bit samples into one array per channel
+ *  @param in Interleaved samples
+ *  @param chans Number of channels
+ *  @param n Number of samples per channel
+ *  @param out Output; one array per channel
+ *  @param at Offset in each output array to start writing at
+ *
+ *  The usual channel counts get their own copies with a fixed stride, which
+ *  the compiler turns into vector loads and shuffles.
+ */
+void wav_deinterleave(const int16_t *in, int chans, size_t n, int16_t **out, size_t at)
+{
+	switch (chans) {
+	case 1:  deinterleave(in, 1, n, out, at); break;
+	case 2:  deinterleave(in, 2, n, out, at); break;
+	case 4:  deinterleave(in, 4, n, out, at); break;
+	case 6:  deinterleave(in, 6, n, out, at); break;
+	case 8:  deinterleave(in, 8, n, out, at); break;
+	case 12: deinterleave(in, 12, n, out, at); break;
+	case 16: deinterleave(in, 16, n, out, at); break;
+	default: deinterleave(in, chans, n, out, at); break;
 	}
-	file_end = file + total_size;
+}
 
-	/* read format info chunk */
-	chunk_len = read_chunk((char*)&wav_header.fmt, file + offset, file_end,
-	                       "fmt ", sizeof(wav_header.fmt));
-	if (chunk_len < sizeof(wav_header.fmt)) {
-		fprintf(stderr, "%s: bad 'fmt ' chunk: %zd\n", filename, chunk_len);
-		goto out;
+/** @brief Maps a 16-bit mono WAV file into memory
+ *  @param filename Name of file to map
+ *  @param wav Output; the mapped file
+ *  @return 0 on success, negative on failure
+ *
+ *  Only the headers are looked at here; the samples are paged in from the
+ *  file as they're used, so this returns straight away however long the
+ *  recording is.
+ */
+int wav_map(const char *filename, wav_map_t *wav)
+{
+	ssize_t total_size = 0, offset;
+	struct stat stats;
+	char *file = MAP_FAILED;
+	wav_info_t info;
+
+	memset(wav, 0, sizeof(*wav));
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "%s: error opening file: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &stats) == -1) {
+		fprintf(stderr, "%s: cannot stat file: %s\n", filename, strerror(errno));
+		goto fail;
+	}
+	total_size = stats.st_size;
+	if (total_size < sizeof(wav_t)) {
+		fprintf(stderr, "%s: too short to be a WAV file\n", filename);
+		goto fail;
+	}
+
+	file = mmap(NULL, total_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file == MAP_FAILED) {
+		fprintf(stderr, "%s: cannot map file: %s\n", filename, strerror(errno));
+		goto fail;
 	}
-	offset += chunk_len;
 
-	/* only accept 16-bit mono */
-	if (wav_header.fmt.chans != 1 || wav_header.fmt.bps != 16) {
-		fprintf(stderr, "%s: unsupported file type - %d channels, %d bit\n",
-		        filename, wav_header.fmt.chans, wav_header.fmt.bps);
-		goto out;
+	offset = parse_header(filename, file, total_size, total_size, &info);
+	if (offset < 0) {
+		goto fail;
+	}
+	if (info.chans != 1) {
+		fprintf(stderr, "%s: %d channels, only mono files can be mapped\n",
+		        filename, info.chans);
+		goto fail;
 	}
 
-	/* read data chunk header */
-	chunk_len = read_chunk((char*)&wav_header.data, file + offset, file_end,
-	                       "data", sizeof(wav_header.data));
-	if (chunk_len < sizeof(wav_header.data)) {
-		fprintf(stderr, "%s: bad 'data' chunk: %zd\n", filename, chunk_len);
-		goto out;
+	/* samples are used in place, so they must be aligned */
+	if (offset & 1) {
+		fprintf(stderr, "%s: misaligned 'data' chunk\n", filename);
+		goto fail;
 	}
-	offset += sizeof(wav_header.data);
 
-	/* use the shorter of the header-specified size or the file size */
-	int16_t *data = (int16_t*)(file + offset);
-	wav_len = wav_header.data.size / 2;
-	file_len = (total_size - offset) / 2;
-	len = wav_len > file_len ? file_len : wav_len;
+	madvise(file, total_size, MADV_SEQUENTIAL);
+	close(fd);
 
-	samples = malloc(len * sizeof(real_t));
-	if (samples == NULL) {
-		fprintf(stderr, "%s: cannot allocate memory for %lu samples\n", filename, len);
-		goto out;
+	wav->rate = info.rate;
+	wav->len = info.len;
+	wav->data = (const int16_t*)(file + offset);
+	wav->map = file;
+	wav->map_len = total_size;
+	return 0;
+
+fail:
+	if (file != MAP_FAILED) {
+		munmap(file, total_size);
+	}
+	close(fd);
+	memset(wav, 0, sizeof(*wav));
+	return -1;
+}
+
+/** @brief Opens a 16-bit WAV file for reading its samples with `pread`
+ *  @param filename Name of file to open
+ *  @param info Output; format of the file
+ *  @param offset_out Output; offset of the first sample in the file
+ *  @return File descriptor, or negative on failure
+ */
+int wav_open(const char *filename, wav_info_t *info, off_t *offset_out)
+{
+	char *header = NULL;
+	ssize_t avail, offset;
+	struct stat stats;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "%s: error opening file: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &stats) == -1) {
+		fprintf(stderr, "%s: cannot stat file: %s\n", filename, strerror(errno));
+		goto fail;
+	}
+
+	header = malloc(WAV_HEADER_MAX);
+	if (header == NULL) {
+		fprintf(stderr, "%s: cannot allocate memory for header\n", filename);
+		goto fail;
 	}
+	avail = pread(fd, header, WAV_HEADER_MAX, 0);
+	if (avail < 0) {
+		fprintf(stderr, "%s: cannot read header: %s\n", filename, strerror(errno));
+		goto fail;
+	}
+
+	offset = parse_header(filename, header, avail, stats.st_size, info);
+	if (offset < 0) {
+		goto fail;
+	}
+
+	free(header);
+	*offset_out = offset;
+	return fd;
+
+fail:
+	free(header);
+	close(fd);
+	return -1;
+}
+
+/** @brief Unmaps a WAV file mapped by `wav_map`
+ *  @param wav File to unmap
+ */
+void wav_unmap(wav_map_t *wav)
+{
+	if (wav->map != NULL) {
+		munmap(wav->map, wav->map_len);
+	}
+	memset(wav, 0, sizeof(*wav));
+}
+
+/** @brief Converts a window of a mapped WAV file to floating point samples
+ *  @param wav Mapped file
+ *  @param start First sample to convert
+ *  @param n Number of samples to convert
+ *  @param out Output; `n` samples, zero past the end of the file
+ *  @return Number of samples actually in the file
+ */
+size_t wav_map_read(const wav_map_t *wav, size_t start, size_t n, real_t *out)
+{
+	const real_t scale = 1.0 / (real_t)((size_t)INT16_MAX + 1);
+	size_t avail = start >= wav->len ? 0 : wav->len - start;
 
-	real_t scale = 1.0 / (real_t)((size_t)INT16_MAX + 1);
-	for (ssize_t i = 0; i < len; i++) {
-		samples[i] = (real_t)data[i] * scale;
+	avail = avail < n ? avail : n;
+	for (size_t i = 0; i < avail; i++) {
+		out[i] = (real_t)wav->data[start + i] * scale;
 	}
+	memset(out + avail, 0, (n - avail) * sizeof(out[0]));
 
-	*len_out = len;
-	*sample_rate_out = wav_header.fmt.rate;
-out:
-	file_free(file);
-	return samples;
+	return avail;
 }
 
-/** @brief Writes an array of 16-bit samples into a 16-bit mono WAV file
- *  @param filename Name of file to write
- *  @param sample_rate Sample rate
- *  @param data Sample data
- *  @param len Number of samples
+/** @brief Starts writing a 16-bit WAV file
+ *  @param w Writer to initialize
+ *  @param filename Name of file to write; an existing file is replaced
+ *  @param rate Sample rate
+ *  @param chans Number of channels
  *  @return 0 on success, negative on failure
  */
-int wav_write_mono_16(const char *filename, int32_t sample_rate, int16_t *data, size_t len)
+int wav_writer_open(wav_writer_t *w, const char *filename, int32_t rate, int chans)
 {
-	wav_t wav_header;
-	size_t bytes, data_len = len * 2;
+	wav_t header;
 
-	if (len > (size_t)INT_MAX || data_len < len) {
+	memset(w, 0, sizeof(*w));
+	w->fd = -1;
+	w->chans = chans;
+	w->filename = strdup(filename);
+	if (w->filename == NULL || chans < 1 || chans > INT16_MAX / 2) {
+		free(w->filename);
 		return -1;
 	}
 
-	int fd = open(filename, O_WRONLY | O_CREAT, 0666);
-	if (fd == -1) {
-		fprintf(stderr, "%s: could not open output file for writing\n", filename);
+	w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (w->fd == -1) {
+		fprintf(stderr, "%s: could not open output file for writing: %s\n", filename, strerror(errno));
+		free(w->filename);
 		return -1;
 	}
 
-	memcpy(&wav_header, &wav_header_mono_16, sizeof(wav_header));
-	wav_header.hdr.size   += data_len;
-	wav_header.data.size  += data_len;
-	wav_header.fmt.rate    = sample_rate;
-	wav_header.fmt.byps    = sample_rate * 2;
+	/* sizes stay zero until `wav_writer_close` */
+	memcpy(&header, &wav_header_mono_16, sizeof(header));
+	header.fmt.chans = chans;
+	header.fmt.rate  = rate;
+	header.fmt.byps  = rate * 2 * chans;
+	header.fmt.align = 2 * chans;
+	if (file_write_all(w->fd, &header, sizeof(header), -1) < 0) {
+		fprintf(stderr, "%s: could not write wav header: %s\n", filename, strerror(errno));
+		close(w->fd);
+		free(w->filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** @brief Appends samples to a WAV file
+ *  @param w Writer
+ *  @param data Interleaved samples
+ *  @param n Number of samples per channel
+ *  @return 0 on success, negative on failure
+ *
+ *  After a failure the file is incomplete; later appends are ignored and
+ *  `wav_writer_close` reports it.
+ */
+int wav_writer_append(wav_writer_t *w, const int16_t *data, size_t n)
+{
+	size_t bytes = n * 2 * w->chans;
 
-	if ((bytes = write(fd, &wav_header, sizeof(wav_header))) < sizeof(wav_header)) {
-		fprintf(stderr, "warning: %s: wrote %lu bytes of wav header - file corrupt\n", filename, bytes);
+	if (w->failed) {
+		return -1;
 	}
-	if ((bytes = write(fd, data, data_len)) < data_len) {
-		fprintf(stderr, "warning: %s: wrote %lu/%lu bytes of data - file incomplete\n", filename, bytes, data_len);
+
+	/* sizes in the header are 32 bits */
+	if (n > (INT32_MAX - sizeof(wav_t)) / (2 * w->chans) - w->len) {
+		fprintf(stderr, "%s: too long for a wav file\n", w->filename);
+		w->failed = 1;
+		return -1;
 	}
 
-	if (close(fd) < 0) {
-		fprintf(stderr, "warning: %s: failed to close\n", filename);
+	if (file_write_all(w->fd, data, bytes, -1) < 0) {
+		fprintf(stderr, "%s: could not write samples: %s\n", w->filename, strerror(errno));
+		w->failed = 1;
+		return -1;
 	}
 
+	w->len += n;
 	return 0;
 }
+
+/** @brief Fills in the header of a WAV file and closes it
+ *  @param w Writer
+ *  @return 0 on success, negative if anything went wrong writing the file
+ */
+int wav_writer_close(wav_writer_t *w)
+{
+	int32_t data_len = w->len * 2 * w->chans, riff_len = data_len + sizeof(wav_t) - 8;
+	int ret = w->failed ? -1 : 0;
+
+	if (!w->failed &&
+	    (file_write_all(w->fd, &riff_len, sizeof(riff_len), offsetof(wav_t, hdr.size)) < 0 ||
+	     file_write_all(w->fd, &data_len, sizeof(data_len), offsetof(wav_t, data.size)) < 0)) {
+		fprintf(stderr, "%s: could not write wav header: %s\n", w->filename, strerror(errno));
+		ret = -1;
+	}
+	if (close(w->fd) < 0) {
+		fprintf(stderr, "%s: failed to close: %s\n", w->filename, strerror(errno));
+		ret = -1;
+	}
+
+	free(w->filename);
+	w->filename = NULL;
+	w->fd = -1;
+	return ret;
+}
@@ -1,11 +1,50 @@
 #ifndef _WAV_H_
 #define _WAV_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include "globals.h"
 
-real_t *wav_read_mono_16(const char *filename, int32_t *sample_rate_out, size_t *len_out);
-int wav_write_mono_16(const char *filename, int32_t sample_rate, int16_t *data, size_t len);
+/* headers, including any LIST and other chunks before the samples, must
+ * fit in this many bytes for `wav_open`
+ */
+#define WAV_HEADER_MAX 65536
+
+typedef struct {
+	int32_t rate;
+	int chans;
+	size_t len; /* number of samples per channel */
+} wav_info_t;
+
+/* 16-bit mono WAV file mapped into memory; the samples are used in place */
+typedef struct {
+	int32_t rate;
+	size_t len;           /* number of samples */
+	const int16_t *data;  /* samples, inside the mapping */
+	void *map;
+	size_t map_len;
+} wav_map_t;
+
+int wav_map(const char *filename, wav_map_t *wav);
+void wav_unmap(wav_map_t *wav);
+size_t wav_map_read(const wav_map_t *wav, size_t start, size_t n, real_t *out);
+
+/* 16-bit WAV file being written a block at a time */
+typedef struct {
+	int fd;
+	char *filename;
+	int chans;
+	size_t len;  /* samples per channel written so far */
+	int failed;
+} wav_writer_t;
+
+int wav_open(const char *filename, wav_info_t *info, off_t *offset_out);
+void wav_deinterleave(const int16_t *in, int chans, size_t n, int16_t **out, size_t at);
+
+int wav_writer_open(wav_writer_t *w, const char *filename, int32_t rate, int chans);
+int wav_writer_append(wav_writer_t *w, const int16_t *data, size_t n);
+int wav_writer_close(wav_writer_t *w);
 
 #endif /* _WAV_H_ */
@@ -0,0 +1,236 @@
+/** @file whiten.c
+ *  @brief PHAT-weighted cross-spectrum kernel
+ *
+ *  For each bin k of two interleaved complex spectra a and b, computes
+ *
+ *  out[k] = w[k] * a[k] conj(b[k]) / |a[k] conj(b[k])|
+ *
+ *  i.e. the cross-spectrum with its magnitude normalized away. This runs for
+ *  every bin of every pair of every frame, so on x86 there are SSE4.1, AVX2
+ *  and AVX-512 versions, picked at run time for the CPU at hand. They use
+ *  the approximate reciprocal square root plus one Newton step instead of a
+ *  square root and division, which is accurate to about a float ulp.
+ *
+ *  The kernel to use can be forced with $LOC_SIMD (scalar, sse4.1, avx2 or
+ *  avx512) for testing.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "whiten.h"
+
+#if !defined(USE_DOUBLE) && (defined(__x86_64__) || defined(__i386__))
+#define WHITEN_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*whiten_fn_t)(const real_t *a, const real_t *b, const real_t *weight, int n,
+                            real_t *out);
+
+static whiten_fn_t whiten_fn;
+static const char *whiten_fn_name;
+static pthread_once_t whiten_once = PTHREAD_ONCE_INIT;
+
+/** @brief Portable version of `whiten` */
+static void whiten_scalar(const real_t *a, const real_t *b, const real_t *weight, int n,
+                          real_t *out)
+{
+	for (int k = 0; k < n; k++) {
+		real_t ar = a[2 * k], ai = a[2 * k + 1], br = b[2 * k], bi = b[2 * k + 1];
+		real_t x = ar * br + ai * bi, y = ai * br - ar * bi;
+		real_t m2 = x * x + y * y;
+		real_t r = 1.0 / sqrt(m2 > WHITEN_EPS2 ? m2 : WHITEN_EPS2);
+
+		r = weight == NULL ? r : r * weight[k];
+		out[2 * k] = x * r;
+		out[2 * k + 1] = y * r;
+	}
+}
+
+#ifdef WHITEN_X86
+
+/* Each vector holds interleaved (re, im) pairs. With P = a * b and
+ * Q = a * swap(b), where swap exchanges the two halves of each pair:
+ *
+ *  even lanes of P + swap(P) = ar br + ai bi = Re(a conj(b))
+ *  odd lanes of Q - swap(Q)  = ai br - ar bi = Im(a conj(b))
+ *
+ * Blending those gives the cross-spectrum, still interleaved, and adding the
+ * squared vector to its swap puts the squared magnitude in both lanes.
+ */
+
+__attribute__((target("sse4.1")))
+static void whiten_sse41(const real_t *a, const real_t *b, const real_t *weight, int n,
+                         real_t *out)
+{
+	const __m128 eps = _mm_set1_ps(WHITEN_EPS2), half = _mm_set1_ps(0.5f);
+	const __m128 three_half = _mm_set1_ps(1.5f);
+	int k;
+
+	for (k = 0; k + 2 <= n; k += 2) {
+		__m128 va = _mm_loadu_ps(a + 2 * k), vb = _mm_loadu_ps(b + 2 * k);
+		__m128 p = _mm_mul_ps(va, vb);
+		__m128 q = _mm_mul_ps(va, _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(2, 3, 0, 1)));
+		__m128 x = _mm_add_ps(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 3, 0, 1)));
+		__m128 y = _mm_sub_ps(q, _mm_shuffle_ps(q, q, _MM_SHUFFLE(2, 3, 0, 1)));
+		__m128 c = _mm_blend_ps(x, y, 0xa);
+		__m128 c2 = _mm_mul_ps(c, c);
+		__m128 m2 = _mm_add_ps(c2, _mm_shuffle_ps(c2, c2, _MM_SHUFFLE(2, 3, 0, 1)));
+		m2 = _mm_max_ps(m2, eps);
+
+		/* r = r0 * (1.5 - 0.5 * m2 * r0^2) */
+		__m128 r = _mm_rsqrt_ps(m2);
+		r = _mm_mul_ps(r, _mm_sub_ps(three_half,
+		                             _mm_mul_ps(_mm_mul_ps(half, m2), _mm_mul_ps(r, r))));
+
+		if (weight != NULL) {
+			__m128 w = _mm_castpd_ps(_mm_load_sd((const double *)(weight + k)));
+			r = _mm_mul_ps(r, _mm_unpacklo_ps(w, w));
+		}
+		_mm_storeu_ps(out + 2 * k, _mm_mul_ps(c, r));
+	}
+
+	whiten_scalar(a + 2 * k, b + 2 * k, weight == NULL ? NULL : weight + k, n - k, out + 2 * k);
+}
+
+__attribute__((target("avx2,fma")))
+static void whiten_avx2(const real_t *a, const real_t *b, const real_t *weight, int n,
+                        real_t *out)
+{
+	const __m256 eps = _mm256_set1_ps(WHITEN_EPS2), half = _mm256_set1_ps(0.5f);
+	const __m256 three_half = _mm256_set1_ps(1.5f);
+	const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+	int k;
+
+	for (k = 0; k + 4 <= n; k += 4) {
+		__m256 va = _mm256_loadu_ps(a + 2 * k), vb = _mm256_loadu_ps(b + 2 * k);
+		__m256 p = _mm256_mul_ps(va, vb);
+		__m256 q = _mm256_mul_ps(va, _mm256_permute_ps(vb, 0xb1));
+		__m256 x = _mm256_add_ps(p, _mm256_permute_ps(p, 0xb1));
+		__m256 y = _mm256_sub_ps(q, _mm256_permute_ps(q, 0xb1));
+		__m256 c = _mm256_blend_ps(x, y, 0xaa);
+		__m256 c2 = _mm256_mul_ps(c, c);
+		__m256 m2 = _mm256_max_ps(_mm256_add_ps(c2, _mm256_permute_ps(c2, 0xb1)), eps);
+
+		__m256 r = _mm256_rsqrt_ps(m2);
+		r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(half, m2), _mm256_mul_ps(r, r),
+		                                      three_half));
+
+		if (weight != NULL) {
+			__m256 w = _mm256_castps128_ps256(_mm_loadu_ps(weight + k));
+			r = _mm256_mul_ps(r, _mm256_permutevar8x32_ps(w, dup));
+		}
+		_mm256_storeu_ps(out + 2 * k, _mm256_mul_ps(c, r));
+	}
+
+	whiten_scalar(a + 2 * k, b + 2 * k, weight == NULL ? NULL : weight + k, n - k, out + 2 * k);
+}
+
+__attribute__((target("avx512f")))
+static void whiten_avx512(const real_t *a, const real_t *b, const real_t *weight, int n,
+                          real_t *out)
+{
+	const __m512 eps = _mm512_set1_ps(WHITEN_EPS2), half = _mm512_set1_ps(0.5f);
+	const __m512 three_half = _mm512_set1_ps(1.5f);
+	const __m512i dup = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7);
+	int k;
+
+	for (k = 0; k + 8 <= n; k += 8) {
+		__m512 va = _mm512_loadu_ps(a + 2 * k), vb = _mm512_loadu_ps(b + 2 * k);
+		__m512 p = _mm512_mul_ps(va, vb);
+		__m512 q = _mm512_mul_ps(va, _mm512_permute_ps(vb, 0xb1));
+		__m512 x = _mm512_add_ps(p, _mm512_permute_ps(p, 0xb1));
+		__m512 y = _mm512_sub_ps(q, _mm512_permute_ps(q, 0xb1));
+		__m512 c = _mm512_mask_blend_ps(0xaaaa, x, y);
+		__m512 c2 = _mm512_mul_ps(c, c);
+		__m512 m2 = _mm512_max_ps(_mm512_add_ps(c2, _mm512_permute_ps(c2, 0xb1)), eps);
+
+		__m512 r = _mm512_rsqrt14_ps(m2);
+		r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(half, m2), _mm512_mul_ps(r, r),
+		                                      three_half));
+
+		if (weight != NULL) {
+			__m512 w = _mm512_castps256_ps512(_mm256_loadu_ps(weight + k));
+			r = _mm512_mul_ps(r, _mm512_permutexvar_ps(dup, w));
+		}
+		_mm512_storeu_ps(out + 2 * k, _mm512_mul_ps(c, r));
+	}
+
+	whiten_scalar(a + 2 * k, b + 2 * k, weight == NULL ? NULL : weight + k, n - k, out + 2 * k);
+}
+
+#endif /* WHITEN_X86 */
+
+/** @brief Checks whether the CPU can run a kernel
+ *  @param name Kernel name
+ *  @return Nonzero if supported
+ */
+static int cpu_has(const char *name)
+{
+#ifdef WHITEN_X86
+	__builtin_cpu_init();
+	if (!strcmp(name, "avx512")) {
+		return __builtin_cpu_supports("avx512f");
+	}
+	if (!strcmp(name, "avx2")) {
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	}
+	if (!strcmp(name, "sse4.1")) {
+		return __builtin_cpu_supports("sse4.1");
+	}
+#endif
+	return !strcmp(name, "scalar");
+}
+
+/** @brief Picks the best kernel for this CPU, or the one named in $LOC_SIMD */
+static void whiten_select(void)
+{
+	static const struct {
+		const char *name;
+		whiten_fn_t fn;
+	} kernels[] = {
+#ifdef WHITEN_X86
+		{ "avx512", whiten_avx512 },
+		{ "avx2",   whiten_avx2 },
+		{ "sse4.1", whiten_sse41 },
+#endif
+		{ "scalar", whiten_scalar },
+	};
+	const char *force = getenv("LOC_SIMD");
+
+	for (int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (cpu_has(kernels[i].name) && (force == NULL || !strcmp(force, kernels[i].name))) {
+			whiten_fn = kernels[i].fn;
+			whiten_fn_name = kernels[i].name;
+			return;
+		}
+	}
+
+	whiten_fn = whiten_scalar;
+	whiten_fn_name = "scalar";
+}
+
+/** @brief Computes the whitened cross-spectrum of two spectra
+ *  @param a First spectrum, `n` interleaved complex values
+ *  @param b Second spectrum, `n` interleaved complex values
+ *  @param weight Weight of each bin, or NULL for none
+ *  @param n Number of bins
+ *  @param out Output; `n` interleaved complex values, may not alias `a` or `b`
+ */
+void whiten(const real_t *a, const real_t *b, const real_t *weight, int n, real_t *out)
+{
+	pthread_once(&whiten_once, whiten_select);
+	whiten_fn(a, b, weight, n, out);
+}
+
+/** @brief Gets the name of the kernel `whiten` uses
+ *  @return Kernel name, e.g. "avx2"
+ */
+const char *whiten_name(void)
+{
+	pthread_once(&whiten_once, whiten_select);
+	return whiten_fn_name;
+}
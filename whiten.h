@@ -0,0 +1,14 @@
+#ifndef _WHITEN_H_
+#define _WHITEN_H_
+
+#include "globals.h"
+
+/* squared cross-spectrum magnitudes below this are treated as this, so empty
+ * bins come out as zero rather than NaN
+ */
+#define WHITEN_EPS2 1e-30
+
+void whiten(const real_t *a, const real_t *b, const real_t *weight, int n, real_t *out);
+const char *whiten_name(void);
+
+#endif /* _WHITEN_H_ */